@@ -23,8 +23,12 @@ class BlockList{
     private:
     MallocMetadata* head;
     MallocMetadata* tail;
+    size_t num_blocks; //the statistics are kept up to date instead of walking the list
+    size_t num_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
     public:
-        BlockList() : head(NULL) , tail(NULL){}
+        BlockList() : head(NULL) , tail(NULL), num_blocks(0), num_bytes(0), free_blocks(0), free_bytes(0){}
         
         void* allocateBlock(size_t size)
         {
@@ -41,6 +45,8 @@ class BlockList{
                 head->is_free=false;
                 head->addr=new_address;
                 tail=head;
+                num_blocks++;
+                num_bytes+=size;
                 return new_address;
             }
             else
@@ -51,6 +57,8 @@ class BlockList{
                 if(ptr!=NULL)
                 {
                     ptr->is_free=false;
+                    free_blocks--;
+                    free_bytes-=ptr->size-sizeof(MallocMetadata);
                     return ptr->addr;
                 }
                 else{
@@ -65,6 +73,8 @@ class BlockList{
                     meta_data_ptr->is_free=false;
                     meta_data_ptr->addr=new_address;
                     tail=meta_data_ptr;
+                    num_blocks++;
+                    num_bytes+=size;
                     return new_address;
                 }
             }
@@ -73,7 +83,11 @@ class BlockList{
         void ListFree(void* p)
         {
             MallocMetadata* md_to_free=(MallocMetadata*)((long)p-sizeof(MallocMetadata));
+            if(md_to_free->is_free)
+                return;
             md_to_free->is_free=true;
+            free_blocks++;
+            free_bytes+=md_to_free->size-sizeof(MallocMetadata);
         }
         
         void* rellocateBlock(void* oldp,size_t size)
@@ -94,64 +108,27 @@ class BlockList{
         
         size_t numFreeBlocks()
         {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                if(ptr->is_free)
-                    counter++;
-                ptr=ptr->next;
-            }
-            return counter;
+            return free_blocks;
         }
 
         size_t numFreeBytes()
         {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                if(ptr->is_free)
-                    counter+=ptr->size-sizeof(MallocMetadata);
-                ptr=ptr->next;
-            }
-            return counter;
+            return free_bytes;
         }
 
         size_t numAllocatedBlocks()
         {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                counter++;
-                ptr=ptr->next;
-            }
-            return counter;
+            return num_blocks;
         }
 
         size_t numAllocatedBytes()
         {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                counter+=ptr->size-sizeof(MallocMetadata);
-                ptr=ptr->next;
-            }
-            return counter;
+            return num_bytes;
         }
 
         size_t numMetaDataBytes()
         {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                counter+=sizeof(MallocMetadata);
-                ptr=ptr->next;
-            }
-            return counter;
+            return num_blocks*sizeof(MallocMetadata);
         }
 
         size_t numMetaData()
@@ -212,69 +212,6 @@ class SbrkBlockList{
         {
             return (head!=NULL && ptr==tail);
         }
-        
-        int numFreeBlocksList()
-        {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                if(ptr->is_free)
-                    counter++;
-                ptr=ptr->histo_next;
-            }
-            return counter;
-        }
-        
-        size_t numFreeBytesList()
-        {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                if(ptr->is_free)
-                    counter+=ptr->size-sizeof(MallocMetadata);
-                ptr=ptr->histo_next;
-            }
-            return counter;
-        }
-
-
-        size_t numAllocatedBlocksList()
-        {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                counter++;
-                ptr=ptr->list_next;
-            }
-            return counter;
-        }
-
-        size_t numAllocatedBytesList()
-        {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                counter+=ptr->size-sizeof(MallocMetadata);
-                ptr=ptr->list_next;
-            }
-            return counter;
-        }
-
-        size_t numMetaDataBytesList()
-        {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                counter+=sizeof(MallocMetadata);
-                ptr=ptr->list_next;
-            }
-            return counter;
-        }
 };
 
 
@@ -285,8 +222,13 @@ class BlockManager
     SbrkBlockList all_blocks_list;
     size_t mmap_allocated_blocks;
     size_t mmap_allocated_bytes;
+    size_t sbrk_blocks; //blocks of all_blocks_list, kept up to date so the statistics never walk the lists
+    size_t sbrk_bytes; //sum of their sizes with metaData, which is all the memory taken by sbrk
+    size_t free_blocks; //blocks in the histogram
+    size_t free_bytes;
 	
-	BlockManager() :all_blocks_list(), mmap_allocated_blocks(0), mmap_allocated_bytes(0)
+	BlockManager() :all_blocks_list(), mmap_allocated_blocks(0), mmap_allocated_bytes(0), sbrk_blocks(0),
+                    sbrk_bytes(0), free_blocks(0), free_bytes(0)
     {
         for(int i=0;i<NUM_OF_BINS;i++)
             histogram[i]=SbrkBlockList();
@@ -308,6 +250,21 @@ class BlockManager
         else
             return size/BIN_SIZE;
     }
+
+    void InsertToHisto(MallocMetadata* ptr)
+    {
+        histogram[IndexOfHisto(ptr->size-sizeof(MallocMetadata))].insertBySizeHisto(ptr);
+        free_blocks++;
+        free_bytes+=ptr->size-sizeof(MallocMetadata);
+    }
+
+    void RemoveFromHisto(MallocMetadata* ptr)
+    {
+        histogram[IndexOfHisto(ptr->size-sizeof(MallocMetadata))].removeHisto(ptr);
+        free_blocks--;
+        free_bytes-=ptr->size-sizeof(MallocMetadata);
+    }
+
     void Split(MallocMetadata* ptr,size_t size)
     {
         MallocMetadata* md_new_free = (MallocMetadata*)((long)(ptr)+(long)(size));
@@ -319,7 +276,8 @@ class BlockManager
         else
             all_blocks_list.insertAfterBlockList(md_new_free,ptr);
         md_new_free->is_free=true;
-        histogram[IndexOfHisto(md_new_free->size-sizeof(MallocMetadata))].insertBySizeHisto(md_new_free);    
+        sbrk_blocks++;
+        InsertToHisto(md_new_free);
     }
 
     void* BlockAllocate(size_t size)
@@ -368,7 +326,8 @@ class BlockManager
             {
                 if(sbrk(real_size - free_tail->size)==(void*)-1)
                     return NULL;
-                histogram[IndexOfHisto(free_tail->size-sizeof(MallocMetadata))].removeHisto(free_tail);
+                RemoveFromHisto(free_tail);
+                sbrk_bytes+=real_size-free_tail->size;
                 free_tail->size=real_size;
                 free_tail->is_free=false;
                 return free_tail->addr;
@@ -385,13 +344,15 @@ class BlockManager
                 meta_data_ptr->is_free=false;
                 meta_data_ptr->addr=new_address;
                 all_blocks_list.insertAtListEnd(meta_data_ptr);
+                sbrk_blocks++;
+                sbrk_bytes+=real_size;
                 return new_address;
             }
         }
         else
         {
             //remove from histo list and update block isnt free
-            histogram[i].removeHisto(ptr_to_allocate_at); 
+            RemoveFromHisto(ptr_to_allocate_at);
             ptr_to_allocate_at->is_free = false;
             if((long)(ptr_to_allocate_at->size-real_size)>=MIN_SPLIT_SIZE)//splitting
                 Split(ptr_to_allocate_at, real_size);
@@ -423,7 +384,7 @@ class BlockManager
             if (all_blocks_list.IsBlockFree(md_to_free))
                 return;
             md_to_free->is_free=true;
-            histogram[IndexOfHisto(md_to_free->size-sizeof(MallocMetadata))].insertBySizeHisto(md_to_free);
+            InsertToHisto(md_to_free);
             if(all_blocks_list.IsPrevFree(md_to_free))
                 md_to_free=Merge(md_to_free->list_prev,true,false);
             if(all_blocks_list.IsNextFree(md_to_free))
@@ -436,13 +397,13 @@ class BlockManager
     {
         MallocMetadata* second_block=all_blocks_list.removeList(first_block->list_next);
         MallocMetadata* md_to_free= mirror? second_block: first_block;
-        histogram[IndexOfHisto(md_to_free->size-sizeof(MallocMetadata))].removeHisto(md_to_free);
+        RemoveFromHisto(md_to_free);
+        if(free)
+            RemoveFromHisto(second_block);
         first_block->size+=second_block->size;
+        sbrk_blocks--;
         if(free)
-        {
-            histogram[IndexOfHisto(second_block->size-sizeof(MallocMetadata))].removeHisto(second_block);
-            histogram[IndexOfHisto(first_block->size-sizeof(MallocMetadata))].insertBySizeHisto(first_block);
-        }
+            InsertToHisto(first_block);
         else
             first_block->is_free=false;
         return first_block;
@@ -508,6 +469,7 @@ class BlockManager
         {
             if(sbrk(real_size - md_to_realloc->size)==(void*)-1)
                 return NULL;
+            sbrk_bytes+=real_size-md_to_realloc->size;
             md_to_realloc->size=real_size;
             return oldp;
         }
@@ -525,33 +487,27 @@ class BlockManager
 
     size_t numFreeBlocks()
     {
-        size_t counter=0;
-        for(int i=0;i<NUM_OF_BINS;i++)
-            counter+=histogram[i].numFreeBlocksList();
-        return counter;
+        return free_blocks;
     }
 
     size_t numFreeBytes()
     {
-        size_t counter=0;
-        for(int i=0;i<NUM_OF_BINS;i++)
-            counter+=histogram[i].numFreeBytesList();
-        return counter;
+        return free_bytes;
     }
 
     size_t numAllocatedBlocks()
     {
-        return all_blocks_list.numAllocatedBlocksList()+mmap_allocated_blocks;
+        return sbrk_blocks+mmap_allocated_blocks;
     }
 
     size_t numAllocatedBytes()
     {
-        return all_blocks_list.numAllocatedBytesList()+mmap_allocated_bytes;
+        return sbrk_bytes-sbrk_blocks*sizeof(MallocMetadata)+mmap_allocated_bytes;
     }
 
     size_t numMetaDataBytes()
     {
-        return all_blocks_list.numMetaDataBytesList()+mmap_allocated_blocks*sizeof(MallocMetadata);
+        return (sbrk_blocks+mmap_allocated_blocks)*sizeof(MallocMetadata);
     }
 
     size_t numMetaData()
@@ -3,102 +3,704 @@
 #include <stdbool.h>
 #include <cstdlib>
 #include <cstring>
-#include <iostream>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <new>
+#include <cassert>
+#include <algorithm>
+#include <cstdio>
+#include <cstdarg>
+#include <cmath>
+#include <fcntl.h>
+#include <unwind.h>
 
 
 #define sBlockManager BlockManager::instance()
+#define sSlabAllocator SlabAllocator::instance()
+#define sMmapCache MmapCache::instance()
 
-#define NUM_OF_BINS 128
+#define SL_INDEX_COUNT_LOG2 5
+#define SL_INDEX_COUNT (1<<SL_INDEX_COUNT_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2+3)
+#define FL_INDEX_MAX 39
+#define FL_INDEX_COUNT (FL_INDEX_MAX-FL_INDEX_SHIFT+1)
+#define SMALL_BLOCK_SIZE (1<<FL_INDEX_SHIFT)
+#define NUM_OF_BINS (FL_INDEX_COUNT*SL_INDEX_COUNT)
+#define BEST_FIT_PROBE 8
 #define MIN_SPLIT_SIZE 128
 #define BIN_SIZE 1024
+#ifndef MAX_MALLOC_SIZE
+#ifdef SMALLOC_PRELOAD
+#define MAX_MALLOC_SIZE (1UL<<47) //the whole user address space, as a libc replacement has to serve any request
+#else
 #define MAX_MALLOC_SIZE 100000000
+#endif
+#endif
 #define MMAP_ALLOCATION_MIN_SIZE 128*BIN_SIZE
+#define MMAP_THRESHOLD_MAX (32UL*1024*1024)
+#define SEGMENT_SIZE (64UL*1024*1024)
+#define TRIM_THRESHOLD (128*1024)
+#define RELEASE_THRESHOLD (1024*1024)
+#define RELEASE_ADVICE MADV_DONTNEED
+#define MAX_ARENAS 64
+#define ARENAS_PER_CPU 4
+#define SLAB_MAX_SIZE 1024
+#define SLAB_NUM_CLASSES 20
+#define SLAB_SPAN_SIZE (64*1024)
+#define SLAB_MIN_SLOT_SIZE 16
+#define SLAB_SAMPLED_SLOTS 4 //sampled slots a span tells apart, beyond that every free of the span asks the sampler
+#define SLAB_REGION_SIZE (4UL*1024*1024*1024)
+#define TCACHE_BATCH 16
+#define TCACHE_MAX_COUNT (2*TCACHE_BATCH)
+#define HUGEPAGE_NONE 0
+#define HUGEPAGE_TRANSPARENT 1 //madvise(MADV_HUGEPAGE), the kernel backs with huge pages what it can
+#define HUGEPAGE_EXPLICIT 2 //MAP_HUGETLB from the reserved pool, small pages when the pool runs out
+#ifndef HUGEPAGE_MODE
+#define HUGEPAGE_MODE HUGEPAGE_NONE
+#endif
+#define HUGE_PAGE_SIZE (2UL*1024*1024)
+#ifndef MMAP_CACHE_SLOTS
+#define MMAP_CACHE_SLOTS 16
+#endif
+#ifndef MMAP_CACHE_MAX_BYTES
+#define MMAP_CACHE_MAX_BYTES (64UL*1024*1024)
+#endif
+#ifndef MMAP_CACHE_DECAY_MS
+#define MMAP_CACHE_DECAY_MS 1000
+#endif
+#ifndef MMAP_CACHE_SLACK
+#define MMAP_CACHE_SLACK 4 //a cached mapping serves requests down to 1/MMAP_CACHE_SLACK below its length
+#endif
+#ifndef MALLOC_ALIGNMENT
+#define MALLOC_ALIGNMENT 16 //alignof(max_align_t), 32 or 64 for wider vectors
+#endif
+#if MALLOC_ALIGNMENT!=16 && MALLOC_ALIGNMENT!=32 && MALLOC_ALIGNMENT!=64
+#error "MALLOC_ALIGNMENT has to be 16, 32 or 64"
+#endif
+//thread locals live in the static TLS block, the dynamic one of a preloaded library is allocated with malloc
+#define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
 
 size_t AlignSizeToEight(size_t size)
 {
     return (size%8==0)? size : size+(8-size%8);
 }
 
-typedef struct MallocMetadata{
-    size_t size;
-    bool is_free;
-    void* addr;
-    struct MallocMetadata* list_next;
-    struct MallocMetadata* list_prev;
-    struct MallocMetadata* histo_next;
-    struct MallocMetadata* histo_prev;
-}MallocMetadata;
+size_t AlignSize(size_t size)
+{
+    return (size+MALLOC_ALIGNMENT-1) & ~(size_t)(MALLOC_ALIGNMENT-1);
+}
+
+size_t PageSize()
+{
+    static size_t page_size=sysconf(_SC_PAGESIZE); //initialized once under the guard of the static
+    return page_size;
+}
+
+size_t AlignSizeToPage(size_t size)
+{
+    return (size+PageSize()-1) & ~(PageSize()-1);
+}
+
+//the unit memory is handed back to the OS in, so huge pages are never split
+size_t ReleaseUnit()
+{
+    return (HUGEPAGE_MODE==HUGEPAGE_NONE)? PageSize() : HUGE_PAGE_SIZE;
+}
+
+//length of the mapping of an mmap block, blocks of a huge page or more take whole huge pages when they are on
+size_t MmapLength(size_t block_size)
+{
+    if(HUGEPAGE_MODE!=HUGEPAGE_NONE && block_size>=HUGE_PAGE_SIZE)
+        return (block_size+HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1);
+    return AlignSizeToPage(block_size);
+}
+
+//statistics counters are written under the lock of their owner and read by the _num_* calls without it
+inline void CounterAdd(size_t* counter,size_t delta)
+{
+    __atomic_store_n(counter,*counter+delta,__ATOMIC_RELAXED);
+}
+
+inline void CounterSub(size_t* counter,size_t delta)
+{
+    __atomic_store_n(counter,*counter-delta,__ATOMIC_RELAXED);
+}
 
+inline size_t CounterRead(size_t* counter)
+{
+    return __atomic_load_n(counter,__ATOMIC_RELAXED);
+}
 
+/**
+ * Opt-in profiling, compiled in with -DSMALLOC_PROFILE. It records a log scale histogram of the requested sizes,
+ * hits and misses per histogram bin, counts of the heap operations and system calls, and the latency in cycles
+ * of one public call in PROFILE_SAMPLE_RATE per thread. Without SMALLOC_PROFILE the hooks expand to nothing.
+ * _dump_stats and _query_stat read the results.
+ */
+#ifdef SMALLOC_PROFILE
+#ifndef PROFILE_SAMPLE_RATE
+#define PROFILE_SAMPLE_RATE 64
+#endif
+#define PROFILE_SPLIT 0
+#define PROFILE_MERGE 1
+#define PROFILE_WILDERNESS_EXTEND 2 //the free tail or a block at the end of the heap grows in place
+#define PROFILE_HEAP_EXTEND 3 //a new block from the bump area, what sbrk was
+#define PROFILE_SEGMENT_MAP 4
+#define PROFILE_MMAP 5
+#define PROFILE_MUNMAP 6
+#define PROFILE_MREMAP 7
+#define PROFILE_MADVISE 8
+#define PROFILE_MMAP_CACHE_HIT 9
+#define PROFILE_REMOTE_FREE 10
+#define PROFILE_NUM_EVENTS 11
+#define PROFILE_MALLOC 0
+#define PROFILE_CALLOC 1
+#define PROFILE_REALLOC 2
+#define PROFILE_FREE 3
+#define PROFILE_MEMALIGN 4
+#define PROFILE_NUM_OPS 5
+#define PROFILE_BUCKETS 64 //powers of two, of bytes for the sizes and of cycles for the latencies
 
-class SbrkBlockList{
+const char* const profile_event_names[PROFILE_NUM_EVENTS]={"split","merge","wilderness_extend","heap_extend",
+    "segment_map","mmap","munmap","mremap","madvise","mmap_cache_hit","remote_free"};
+const char* const profile_op_names[PROFILE_NUM_OPS]={"malloc","calloc","realloc","free","memalign"};
+
+/**
+ * All the counters are shared by the threads and updated with relaxed atomics. A Profiler object lives for one
+ * public call and times it when the call is sampled.
+ */
+class Profiler
+{
     private:
-    MallocMetadata* head;
-    MallocMetadata* tail;
-    
+    static size_t events[PROFILE_NUM_EVENTS];
+    static size_t sizes[PROFILE_BUCKETS];
+    static size_t bin_hits[NUM_OF_BINS];
+    static size_t bin_misses[NUM_OF_BINS];
+    static size_t samples[PROFILE_NUM_OPS];
+    static size_t cycles[PROFILE_NUM_OPS];
+    static size_t latencies[PROFILE_NUM_OPS][PROFILE_BUCKETS];
+    static THREAD_LOCAL unsigned int depth; //scalloc and srealloc call smalloc, only the outermost call counts
+    static THREAD_LOCAL unsigned int calls;
+    int op;
+    unsigned long start;
+
+    static unsigned long Now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return ts.tv_sec*1000000000UL+ts.tv_nsec;
+#endif
+    }
+
+    static int Bucket(size_t value)
+    {
+        return 63-__builtin_clzl(value | 1);
+    }
+
+    static void Add(size_t* counter,size_t value)
+    {
+        __atomic_fetch_add(counter,value,__ATOMIC_RELAXED);
+    }
+
+    static size_t Read(size_t* counter)
+    {
+        return __atomic_load_n(counter,__ATOMIC_RELAXED);
+    }
+
     public:
-        SbrkBlockList(): head(NULL) , tail(NULL){}
 
-        MallocMetadata* findBySizeHist(size_t size)
+    Profiler(int op,size_t size) :op(-1), start(0)
+    {
+        if(depth++>0)
+            return;
+        if(op!=PROFILE_FREE)
+            Add(&sizes[Bucket(size)],1);
+        if(++calls%PROFILE_SAMPLE_RATE==0)
+        {
+            this->op=op;
+            start=Now();
+        }
+    }
+
+    ~Profiler()
+    {
+        depth--;
+        if(op<0)
+            return;
+        unsigned long elapsed=Now()-start;
+        Add(&samples[op],1);
+        Add(&cycles[op],elapsed);
+        Add(&latencies[op][Bucket(elapsed)],1);
+    }
+
+    static void Count(int event)
+    {
+        Add(&events[event],1);
+    }
+
+    static void Bin(int bin,bool hit)
+    {
+        Add(hit? &bin_hits[bin] : &bin_misses[bin],1);
+    }
+
+    //the statistics are numbered: events, sizes, bin hits, bin misses, then samples, cycles and latencies of each call
+    static size_t NumEntries()
+    {
+        return PROFILE_NUM_EVENTS+PROFILE_BUCKETS+2*NUM_OF_BINS+PROFILE_NUM_OPS*(2+PROFILE_BUCKETS);
+    }
+
+    static void Name(size_t i,char* name,size_t length)
+    {
+        if(i<PROFILE_NUM_EVENTS)
+            snprintf(name,length,"%s",profile_event_names[i]);
+        else if((i-=PROFILE_NUM_EVENTS)<PROFILE_BUCKETS)
+            snprintf(name,length,"size_2^%zu",i);
+        else if((i-=PROFILE_BUCKETS)<NUM_OF_BINS)
+            snprintf(name,length,"bin_%zu_hits",i);
+        else if((i-=NUM_OF_BINS)<NUM_OF_BINS)
+            snprintf(name,length,"bin_%zu_misses",i);
+        else
+        {
+            i-=NUM_OF_BINS;
+            const char* op=profile_op_names[i/(2+PROFILE_BUCKETS)];
+            i%=2+PROFILE_BUCKETS;
+            if(i==0)
+                snprintf(name,length,"%s_samples",op);
+            else if(i==1)
+                snprintf(name,length,"%s_cycles",op);
+            else
+                snprintf(name,length,"%s_cycles_2^%zu",op,i-2);
+        }
+    }
+
+    static size_t Value(size_t i)
+    {
+        if(i<PROFILE_NUM_EVENTS)
+            return Read(&events[i]);
+        if((i-=PROFILE_NUM_EVENTS)<PROFILE_BUCKETS)
+            return Read(&sizes[i]);
+        if((i-=PROFILE_BUCKETS)<NUM_OF_BINS)
+            return Read(&bin_hits[i]);
+        if((i-=NUM_OF_BINS)<NUM_OF_BINS)
+            return Read(&bin_misses[i]);
+        i-=NUM_OF_BINS;
+        int op=i/(2+PROFILE_BUCKETS);
+        i%=2+PROFILE_BUCKETS;
+        if(i==0)
+            return Read(&samples[op]);
+        if(i==1)
+            return Read(&cycles[op]);
+        return Read(&latencies[op][i-2]);
+    }
+};
+
+size_t Profiler::events[PROFILE_NUM_EVENTS];
+size_t Profiler::sizes[PROFILE_BUCKETS];
+size_t Profiler::bin_hits[NUM_OF_BINS];
+size_t Profiler::bin_misses[NUM_OF_BINS];
+size_t Profiler::samples[PROFILE_NUM_OPS];
+size_t Profiler::cycles[PROFILE_NUM_OPS];
+size_t Profiler::latencies[PROFILE_NUM_OPS][PROFILE_BUCKETS];
+THREAD_LOCAL unsigned int Profiler::depth=0;
+THREAD_LOCAL unsigned int Profiler::calls=0;
+
+#define PROFILE_CALL(op,size) Profiler profiler(op,size)
+#define PROFILE_COUNT(event) Profiler::Count(event)
+#define PROFILE_BIN(bin,hit) Profiler::Bin(bin,hit)
+#else
+#define PROFILE_CALL(op,size)
+#define PROFILE_COUNT(event)
+#define PROFILE_BIN(bin,hit)
+#endif
+
+void UnmapMemory(void* addr,size_t length)
+{
+    PROFILE_COUNT(PROFILE_MUNMAP);
+    munmap(addr,length);
+}
+
+/**
+ * Maps length bytes, backed by huge pages when HUGEPAGE_MODE asks for them and length is made of whole huge pages.
+ * huge tells whether they were granted, when they are not available the mapping falls back to small pages.
+ */
+void* MapMemory(size_t length,int flags,bool* huge)
+{
+    void* ptr;
+    *huge=false;
+    if(HUGEPAGE_MODE==HUGEPAGE_EXPLICIT && length%HUGE_PAGE_SIZE==0)
+    {
+        //no MAP_NORESERVE: an empty pool has to fail here and not with SIGBUS on the first touch
+        PROFILE_COUNT(PROFILE_MMAP);
+        ptr=mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(ptr!=(void*)(-1))
         {
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL && ptr->size-AlignSizeToEight(sizeof(MallocMetadata)) <size)
-                ptr=ptr->histo_next;
+            *huge=true;
             return ptr;
         }
+    }
+    if(HUGEPAGE_MODE==HUGEPAGE_TRANSPARENT && length>=HUGE_PAGE_SIZE && length%HUGE_PAGE_SIZE==0)
+    {
+        //only whole 2MB aligned ranges get huge pages, so one more is mapped and the start is trimmed to a boundary
+        PROFILE_COUNT(PROFILE_MMAP);
+        char* mapping=(char*)(mmap(NULL, length+HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0));
+        if(mapping==(char*)(-1))
+            return mapping;
+        char* aligned=(char*)(((unsigned long)mapping+HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1));
+        if(aligned>mapping)
+            UnmapMemory(mapping, aligned-mapping);
+        UnmapMemory(aligned+length, mapping+HUGE_PAGE_SIZE-aligned);
+        *huge= (madvise(aligned,length,MADV_HUGEPAGE)==0);
+        return aligned;
+    }
+    PROFILE_COUNT(PROFILE_MMAP);
+    ptr=mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if(ptr!=(void*)(-1) && HUGEPAGE_MODE==HUGEPAGE_TRANSPARENT && length>=HUGE_PAGE_SIZE)
+        *huge= (madvise(ptr,length,MADV_HUGEPAGE)==0);
+    return ptr;
+}
+
+/**
+ *Header of a heap block, 16 bytes. The size covers the header and the payload, sizes are multiples of
+ *MALLOC_ALIGNMENT so its low bits hold the flags below. Headers sit sixteen bytes before an aligned address.
+ *prev_size is the footer of the previous block: it is written only while the previous block is free
+ *(PREV_FREE_BIT), so physical neighbours are found by address arithmetic.
+ *The histogram links live in the payload of free blocks and cost allocated blocks nothing.
+ */
+typedef struct MallocMetadata{
+    size_t prev_size;
+    size_t size;
+    struct MallocMetadata* histo_next; //free blocks only
+    struct MallocMetadata* histo_prev; //free blocks only
+}MallocMetadata;
+
+#define FREE_BIT 1
+#define PREV_FREE_BIT 2
+#define MMAPPED_BIT 4
+#define RELEASED_BIT 4 //free blocks only: the inner pages were handed back to the OS, allocated blocks use it as MMAPPED_BIT
+#define FLAGS_MASK 7
+#define HUGE_MAPPING 1 //kept in prev_size of mmap blocks with the offset of the header in the mapping
+#define META_DATA_SIZE (2*sizeof(size_t))
+#define MIN_BLOCK_SIZE sizeof(MallocMetadata)
+
+class BlockManager;
+
+/**
+ *Beginning of a heap segment: SEGMENT_SIZE bytes of virtual memory reserved with a single mmap and aligned to
+ *their size, so the arena owning a block is found by masking its address. Fresh blocks are bump allocated from
+ *the start of the segment towards its end, and the kernel commits the pages only once they are touched.
+ *The first block of a segment never has a free block before it, and the used part ends with a sentinel header
+ *of size 0 which is never free, so coalescing never walks out of the segment.
+ */
+#ifdef SMALLOC_HEAP_PROFILE
+#define HEAP_SAMPLE_REGION (64*1024)
+#endif
+
+typedef struct HeapRun{
+    struct HeapRun* next;
+    BlockManager* arena;
+#ifdef SMALLOC_HEAP_PROFILE
+    unsigned char sampled[SEGMENT_SIZE/HEAP_SAMPLE_REGION]; //blocks recorded by the heap sampler per region, sticks at 255
+#endif
+}HeapRun;
+
+#define FENCE_SIZE sizeof(HeapRun)
+//the first header of a segment, placed so its payload is aligned to MALLOC_ALIGNMENT
+#define FIRST_BLOCK_OFFSET (AlignSize(FENCE_SIZE+META_DATA_SIZE)-META_DATA_SIZE)
+
+size_t BlockSize(MallocMetadata* ptr)
+{
+    return ptr->size & ~(size_t)FLAGS_MASK;
+}
+
+bool IsBlockFree(MallocMetadata* ptr)
+{
+    return ptr->size & FREE_BIT;
+}
+
+//called without the lock of the owner, which may be flipping PREV_FREE_BIT in the same word: the bits read here stay
+bool IsMmapped(MallocMetadata* ptr)
+{
+    return (__atomic_load_n(&ptr->size,__ATOMIC_RELAXED) & (MMAPPED_BIT | FREE_BIT))==MMAPPED_BIT;
+}
+
+size_t PayloadSize(MallocMetadata* ptr)
+{
+    return BlockSize(ptr)-META_DATA_SIZE;
+}
+
+void* PayloadOf(MallocMetadata* ptr)
+{
+    return (void*)((long)ptr+META_DATA_SIZE);
+}
+
+MallocMetadata* MetaDataOf(void* ptr)
+{
+    return (MallocMetadata*)((long)ptr-META_DATA_SIZE);
+}
 
-        void insertAfterBlockList(MallocMetadata* ptr_to_insert,MallocMetadata* ptr_before)
+/**
+ * Writes the lines of a heap snapshot straight to a file descriptor through a buffer on the stack.
+ * It is used while the arena locks are held, so it must never allocate, and stdio may.
+ */
+class SnapshotWriter
+{
+    private:
+    int fd;
+    size_t length;
+    char buffer[4096];
+
+    public:
+
+    explicit SnapshotWriter(int fd) :fd(fd), length(0)
+    {
+    }
+
+    ~SnapshotWriter()
+    {
+        Flush();
+    }
+
+    //data goes out unbuffered, after what is buffered
+    void Write(const char* data,size_t size)
+    {
+        if(length>0)
+            Flush();
+        while(size>0)
         {
-            ptr_to_insert->list_next=ptr_before->list_next; // ptr->next = NULL
-            ptr_to_insert->list_prev=ptr_before; // ptr->prev = tail
-            if (ptr_before!= tail)
-                ptr_before->list_next->list_prev=ptr_to_insert; // tail->next->prev = 
-            ptr_before->list_next=ptr_to_insert; //tail->next = ptr
+            ssize_t written=write(fd,data,size);
+            if(written<0 && errno==EINTR)
+                continue;
+            if(written<=0)
+                break;
+            data+=written;
+            size-=written;
         }
+    }
+
+    void Flush()
+    {
+        size_t size=length;
+        length=0;
+        Write(buffer,size);
+    }
 
-        void insertAtListEnd(MallocMetadata* ptr)
+    //one line at most 512 bytes long
+    void Printf(const char* format,...)
+    {
+        if(length+512>sizeof(buffer))
+            Flush();
+        va_list args;
+        va_start(args,format);
+        int n=vsnprintf(buffer+length,sizeof(buffer)-length,format,args);
+        va_end(args);
+        if(n>0)
+            length+= ((size_t)n<sizeof(buffer)-length)? n : sizeof(buffer)-length-1;
+    }
+};
+
+#define SNAPSHOT_BUCKETS 64 //free blocks by the power of two of their payload size
+
+//what the walk of the heap segments adds up, the summary line of _dump_heap
+typedef struct HeapSnapshot{
+    size_t segments;
+    size_t used_blocks;
+    size_t used_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t released_blocks;
+    size_t largest_free;
+    size_t free_sizes[SNAPSHOT_BUCKETS];
+}HeapSnapshot;
+
+typedef struct MmapCacheEntry{
+    void* addr;
+    size_t length; //page aligned
+    bool huge;
+    unsigned long stamp; //when it was cached, in milliseconds
+}MmapCacheEntry;
+
+/**
+ * Mappings of freed mmap blocks kept for the next large allocation they fit, which then skips both the mmap
+ * and the page faults. A request takes the smallest cached mapping at most a quarter (MMAP_CACHE_SLACK) longer
+ * than it needs, and the block takes the whole mapping. At most MMAP_CACHE_SLOTS mappings and
+ * MMAP_CACHE_MAX_BYTES are kept, the oldest go first. A mapping unused for MMAP_CACHE_DECAY_MS is unmapped
+ * by the next cache operation, or by _trim.
+ */
+class MmapCache
+{
+    private:
+    MmapCacheEntry entries[MMAP_CACHE_SLOTS];
+    int count;
+    size_t cached_bytes;
+    size_t released_bytes; //unmapped by decay, eviction or flush
+    pthread_mutex_t lock;
+
+    MmapCache() :count(0), cached_bytes(0), released_bytes(0)
+    {
+        pthread_mutex_init(&lock,NULL);
+    }
+
+    static unsigned long Now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+        return ts.tv_sec*1000+ts.tv_nsec/1000000;
+    }
+
+    size_t Unmap(int i)
+    {
+        size_t length=entries[i].length;
+        UnmapMemory(entries[i].addr,length);
+        cached_bytes-=length;
+        released_bytes+=length;
+        entries[i]=entries[--count];
+        return length;
+    }
+
+    size_t Decay(unsigned long now)
+    {
+        size_t counter=0;
+        for(int i=count-1;i>=0;i--)
+            if(now-entries[i].stamp>=MMAP_CACHE_DECAY_MS)
+                counter+=Unmap(i);
+        return counter;
+    }
+
+    int Oldest()
+    {
+        int oldest=0;
+        for(int i=1;i<count;i++)
+            if(entries[i].stamp<entries[oldest].stamp)
+                oldest=i;
+        return oldest;
+    }
+
+    public:
+
+    static MmapCache* instance()
+    {
+        static MmapCache instance;
+        return &instance;
+    }
+
+    //the smallest cached mapping of at least *length bytes and within the slack, NULL if there is none
+    //*length is set to the length of the mapping returned
+    void* Get(size_t* length,bool* huge)
+    {
+        void* addr=NULL;
+        size_t limit=*length+*length/MMAP_CACHE_SLACK;
+        pthread_mutex_lock(&lock);
+        Decay(Now());
+        int best=-1;
+        for(int i=0;i<count;i++)
+            if(entries[i].length>=*length && entries[i].length<=limit && (best<0 || entries[i].length<entries[best].length))
+                best=i;
+        if(best>=0)
         {
-            if(head==NULL)
-            {
-                head=ptr;
-                tail=ptr;
-                head->list_next=NULL;
-                head->list_prev=NULL;
-                return;
-            }
-            insertAfterBlockList(ptr,tail);
-            tail=tail->list_next;
+            addr=entries[best].addr;
+            *huge=entries[best].huge;
+            *length=entries[best].length;
+            cached_bytes-=*length;
+            entries[best]=entries[--count];
+            PROFILE_COUNT(PROFILE_MMAP_CACHE_HIT);
         }
-        
-        void insertAfterBlockHisto(MallocMetadata* ptr_to_insert,MallocMetadata* ptr_before)
+        pthread_mutex_unlock(&lock);
+        return addr;
+    }
+
+    //false if the mapping is too large to be cached, the caller unmaps it
+    bool Put(void* addr,size_t length,bool huge)
+    {
+        if(length>MMAP_CACHE_MAX_BYTES)
+            return false;
+        pthread_mutex_lock(&lock);
+        unsigned long now=Now();
+        Decay(now);
+        while(count==MMAP_CACHE_SLOTS || cached_bytes+length>MMAP_CACHE_MAX_BYTES)
+            Unmap(Oldest());
+        entries[count].addr=addr;
+        entries[count].length=length;
+        entries[count].huge=huge;
+        entries[count].stamp=now;
+        count++;
+        cached_bytes+=length;
+        pthread_mutex_unlock(&lock);
+        return true;
+    }
+
+    size_t numReleasedBytes()
+    {
+        pthread_mutex_lock(&lock);
+        size_t counter=released_bytes;
+        pthread_mutex_unlock(&lock);
+        return counter;
+    }
+
+    //unmaps every cached mapping, returns the bytes unmapped
+    size_t Flush()
+    {
+        size_t counter=0;
+        pthread_mutex_lock(&lock);
+        while(count>0)
+            counter+=Unmap(count-1);
+        pthread_mutex_unlock(&lock);
+        return counter;
+    }
+
+    //a line per cached mapping, returns the bytes cached
+    size_t Dump(SnapshotWriter* out)
+    {
+        pthread_mutex_lock(&lock);
+        for(int i=0;i<count;i++)
+            out->Printf("{\"type\":\"mmap_cached\",\"addr\":%lu,\"size\":%zu}\n",(unsigned long)entries[i].addr,entries[i].length);
+        size_t counter=cached_bytes;
+        pthread_mutex_unlock(&lock);
+        return counter;
+    }
+
+    //held across fork only, every other method takes the lock on its own
+    void Lock()
+    {
+        pthread_mutex_lock(&lock);
+    }
+
+    void Unlock()
+    {
+        pthread_mutex_unlock(&lock);
+    }
+};
+
+class FreeBlockList{
+    private:
+    MallocMetadata* head;
+    MallocMetadata* tail;
+    
+    public:
+        FreeBlockList(): head(NULL) , tail(NULL){}
+
+        bool isEmpty()
         {
-            ptr_to_insert->histo_next=ptr_before->histo_next;
-            ptr_to_insert->histo_prev=ptr_before;
-            if (ptr_before!= tail)
-                ptr_before->histo_next->histo_prev=ptr_to_insert;
-            ptr_before->histo_next=ptr_to_insert;
+            return head==NULL;
         }
 
-        void insertAtHistEnd(MallocMetadata* ptr)
+        MallocMetadata* first()
         {
-            if(head==NULL)
-            {
-                head=ptr;
-                tail=ptr;
-                head->histo_next=NULL;
-                head->histo_prev=NULL;
-                return;
-            }
-            insertAfterBlockHisto(ptr,tail);
-            tail=tail->histo_next;
+            return head;
         }
-        
+
         void insertAtHistBegin(MallocMetadata* ptr)
         {
             ptr->histo_next=head;
             ptr->histo_prev=NULL;
-            head->histo_prev=ptr;
+            if(head==NULL)
+                tail=ptr;
+            else
+                head->histo_prev=ptr;
             head=ptr;
         }
         
@@ -128,489 +730,2706 @@ class SbrkBlockList{
             ptr->histo_prev=NULL;
             return ptr;
         }
+};
 
-        MallocMetadata* removeList(MallocMetadata* ptr)
-        {
-            if (ptr==head && ptr==tail)
-            {
-                head=NULL;
-                tail=NULL;
-            }
-            else if(ptr==head)
-            {
-                head=ptr->list_next;
-                ptr->list_next->list_prev=NULL;
-            }
-            else if(ptr==tail)
-            {
-                tail=ptr->list_prev;
-                ptr->list_prev->list_next=NULL;
-            }
-            else{
-                ptr->list_next->list_prev=ptr->list_prev;
-                ptr->list_prev->list_next=ptr->list_next;
-            }
-            ptr->list_next=NULL;
-            ptr->list_prev=NULL;
-            return ptr;
-        }
 
-        void insertBySizeHisto(MallocMetadata* ptr_to_insert)
+/**
+ * An arena: a heap of mmap segments with its own histogram and lock.
+ * Every thread is assigned an arena round robin the first time it allocates, and a block is always returned
+ * to the arena which owns it.
+ */
+class BlockManager
+{
+    private:
+    FreeBlockList histogram[NUM_OF_BINS];
+    HeapRun* runs;
+    MallocMetadata* heap_end; //sentinel of the newest run
+    char* heap_limit; //end of the newest segment
+    char* heap_clean; //from here to heap_limit the newest segment was never written or was released, it reads as zeros
+    unsigned long fl_bitmap; //bit per first level row of the histogram with a non empty bin
+    unsigned int sl_bitmap[FL_INDEX_COUNT]; //bit per non empty bin in the row
+    MallocMetadata* remote_free; //blocks freed by threads of other arenas, linked through histo_next
+    size_t remote_blocks; //pushed to remote_free and not drained yet, the statistics count them as free
+    size_t remote_bytes;
+    size_t released_bytes; //handed back to the OS so far
+    size_t heap_blocks; //blocks of all the segments, free or not, the statistics need no walk
+    size_t heap_bytes; //sum of their sizes with metaData
+    size_t free_blocks; //blocks in the histogram
+    size_t free_bytes;
+    pthread_mutex_t lock;
+
+    static size_t mmap_allocated_blocks; //mmap blocks are shared by all arenas, updated atomically
+    static size_t mmap_allocated_bytes;
+    static size_t mmap_threshold; //larger requests get a mapping of their own
+    static size_t trim_threshold;
+    static size_t mmap_threshold_updates;
+    static size_t huge_advised_bytes; //segments and mmap blocks mapped with MAP_HUGETLB or advised MADV_HUGEPAGE
+    static BlockManager* arenas[MAX_ARENAS];
+    static unsigned int next_arena;
+    static pthread_mutex_t arenas_lock;
+    static THREAD_LOCAL BlockManager* current;
+
+    BlockManager() :runs(NULL), heap_end(NULL), heap_limit(NULL), heap_clean(NULL), fl_bitmap(0), remote_free(NULL),
+                    remote_blocks(0), remote_bytes(0), released_bytes(0), heap_blocks(0), heap_bytes(0), free_blocks(0), free_bytes(0)
+    {
+        for(int i=0;i<NUM_OF_BINS;i++)
+            histogram[i]=FreeBlockList();
+        for(int i=0;i<FL_INDEX_COUNT;i++)
+            sl_bitmap[i]=0;
+        pthread_mutex_init(&lock,NULL);
+    }
+
+    static BlockManager* MainArena()
+    {
+        static BlockManager instance;
+        return &instance;
+    }
+
+    static unsigned int CountArenas()
+    {
+        long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned long arenas= (cpus>0)? cpus*ARENAS_PER_CPU : ARENAS_PER_CPU;
+        return (arenas<MAX_ARENAS)? arenas : MAX_ARENAS;
+    }
+
+    //initialized once under the guard of the static, the first threads may ask at the same time
+    static unsigned int NumOfArenas()
+    {
+        static unsigned int num_of_arenas=CountArenas();
+        return num_of_arenas;
+    }
+
+    static BlockManager* Arena(unsigned int i)
+    {
+        if(i==0)
+            return MainArena();
+        return __atomic_load_n(&arenas[i],__ATOMIC_ACQUIRE);
+    }
+
+    static BlockManager* AssignArena()
+    {
+        unsigned int i=__atomic_fetch_add(&next_arena,1,__ATOMIC_RELAXED)%NumOfArenas();
+        BlockManager* arena=Arena(i);
+        if(arena!=NULL)
+            return arena;
+        pthread_mutex_lock(&arenas_lock);
+        arena=Arena(i);
+        if(arena==NULL)
         {
-            if(head==NULL) //list is empty
+            void* ptr=mmap(NULL, sizeof(BlockManager), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(ptr==(void*)(-1))
+                arena=MainArena();
+            else
             {
-                head=ptr_to_insert;
-                tail = head;
-                head->histo_next=NULL;
-                head->histo_prev=NULL;
-                return;
+                arena=new(ptr) BlockManager();
+                __atomic_store_n(&arenas[i],arena,__ATOMIC_RELEASE);
             }
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL && ptr->size < ptr_to_insert->size)                    
-                ptr=ptr->histo_next;
-            if(ptr==NULL)//should be tail
-                insertAtHistEnd(ptr_to_insert);
-            else if(ptr==head)//should be head
-                insertAtHistBegin(ptr_to_insert);
-            else
-                insertAfterBlockHisto(ptr_to_insert,ptr->histo_prev);
-        }
-
-        bool IsBlockFree(MallocMetadata* ptr)
-        {
-            return ptr->is_free;
         }
+        pthread_mutex_unlock(&arenas_lock);
+        return arena;
+    }
 
-        bool IsPrevFree(MallocMetadata* ptr)
-        {
-            return (ptr->list_prev!=NULL && IsBlockFree(ptr->list_prev));
+    //reserves a new SEGMENT_SIZE aligned segment, the only system call the heap growth costs
+    HeapRun* MapSegment()
+    {
+        bool huge;
+        PROFILE_COUNT(PROFILE_SEGMENT_MAP);
+        char* ptr=(char*)(MapMemory(2*SEGMENT_SIZE, MAP_NORESERVE, &huge));
+        if(ptr==(char*)(-1))
+            return NULL;
+        if(huge)
+            __atomic_fetch_add(&huge_advised_bytes,SEGMENT_SIZE,__ATOMIC_RELAXED);
+        char* segment=(char*)(((unsigned long)ptr+SEGMENT_SIZE-1) & ~(SEGMENT_SIZE-1));
+        if(segment>ptr)
+            UnmapMemory(ptr,segment-ptr);
+        UnmapMemory(segment+SEGMENT_SIZE,ptr+SEGMENT_SIZE-segment);
+        return (HeapRun*)segment;
+    }
+
+    public:
+
+    //the arena serving the calling thread
+    static BlockManager* instance()
+    {
+        if(current==NULL)
+            current=AssignArena();
+        return current;
+    }
+
+    static BlockManager* OwnerOf(void* ptr)
+    {
+        return ((HeapRun*)((unsigned long)ptr & ~(SEGMENT_SIZE-1)))->arena;
+    }
+
+    //sums a read only counter over all the arenas without their locks, so a read never waits for or changes a heap
+    static size_t SumOverArenas(size_t (BlockManager::*counter)())
+    {
+        size_t sum=0;
+        for(unsigned int i=0;i<NumOfArenas();i++)
+        {
+            BlockManager* arena=Arena(i);
+            if(arena!=NULL)
+                sum+=(arena->*counter)();
+        }
+        return sum;
+    }
+
+    //trims every arena under its lock, after draining its remote frees so the blocks other threads freed are trimmed too
+    static size_t TrimArenas()
+    {
+        size_t counter=0;
+        for(unsigned int i=0;i<NumOfArenas();i++)
+        {
+            BlockManager* arena=Arena(i);
+            if(arena==NULL)
+                continue;
+            arena->Lock();
+            arena->DrainRemoteFrees();
+            counter+=arena->Trim();
+            arena->Unlock();
+        }
+        return counter;
+    }
+
+    static size_t MaxOverArenas(size_t (BlockManager::*counter)())
+    {
+        size_t max=0;
+        for(unsigned int i=0;i<NumOfArenas();i++)
+        {
+            BlockManager* arena=Arena(i);
+            if(arena==NULL)
+                continue;
+            arena->Lock();
+            size_t value=(arena->*counter)();
+            arena->Unlock();
+            if(value>max)
+                max=value;
+        }
+        return max;
+    }
+
+    static void DumpArenas(SnapshotWriter* out,HeapSnapshot* snapshot)
+    {
+        for(unsigned int i=0;i<NumOfArenas();i++)
+        {
+            BlockManager* arena=Arena(i);
+            if(arena==NULL)
+                continue;
+            arena->Lock();
+            arena->DumpHeap(i,out,snapshot);
+            arena->Unlock();
+        }
+    }
+
+    //taken before fork, so the child never inherits an arena in the middle of an update
+    static void LockAll()
+    {
+        pthread_mutex_lock(&arenas_lock);
+        for(unsigned int i=0;i<NumOfArenas();i++)
+            if(Arena(i)!=NULL)
+                Arena(i)->Lock();
+    }
+
+    //the child is a copy of the forking thread, which still owns the locks and can release them
+    static void UnlockAll()
+    {
+        for(unsigned int i=0;i<NumOfArenas();i++)
+            if(Arena(i)!=NULL)
+                Arena(i)->Unlock();
+        pthread_mutex_unlock(&arenas_lock);
+    }
+
+    /**
+     * A thread freeing a block of another arena pushes it here with a single CAS instead of taking the lock
+     * and touching the histogram of the owner. Only the owner pops, and it takes the whole list at once,
+     * so the push needs no ABA protection.
+     */
+    void PushRemoteFree(MallocMetadata* ptr)
+    {
+        __atomic_fetch_add(&remote_blocks,1,__ATOMIC_RELAXED);
+        __atomic_fetch_add(&remote_bytes,PayloadSize(ptr),__ATOMIC_RELAXED);
+        MallocMetadata* head=__atomic_load_n(&remote_free,__ATOMIC_RELAXED);
+        do{
+            ptr->histo_next=head;
+        }while(!__atomic_compare_exchange_n(&remote_free,&head,ptr,true,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    }
+
+    //frees in bulk what other arenas pushed, callers must hold the lock
+    void DrainRemoteFrees()
+    {
+        if(__atomic_load_n(&remote_free,__ATOMIC_RELAXED)==NULL)
+            return;
+        MallocMetadata* ptr=__atomic_exchange_n(&remote_free,(MallocMetadata*)NULL,__ATOMIC_ACQUIRE);
+        size_t blocks=0;
+        size_t bytes=0;
+        while(ptr!=NULL)
+        {
+            MallocMetadata* next=ptr->histo_next;
+            blocks++;
+            bytes+=PayloadSize(ptr);
+            FreeBlock(PayloadOf(ptr));
+            ptr=next;
+        }
+        __atomic_fetch_sub(&remote_blocks,blocks,__ATOMIC_RELAXED);
+        __atomic_fetch_sub(&remote_bytes,bytes,__ATOMIC_RELAXED);
+    }
+
+    //the histogram and the heap of an arena are shared by its threads, callers must hold the lock
+    void Lock()
+    {
+        pthread_mutex_lock(&lock);
+    }
+
+    void Unlock()
+    {
+        pthread_mutex_unlock(&lock);
+    }
+
+    //block size with metaData, the free list links need room in the payload once the block is freed
+    //block sizes are multiples of MALLOC_ALIGNMENT, so every payload after an aligned one is aligned as well
+    size_t RealSize(size_t size)
+    {
+        size_t real_size=AlignSize(size+META_DATA_SIZE);
+        return (real_size<MIN_BLOCK_SIZE)? MIN_BLOCK_SIZE : real_size;
+    }
+
+    void SetSize(MallocMetadata* ptr,size_t size)
+    {
+        ptr->size=size | (ptr->size & FLAGS_MASK);
+    }
+
+    //mirrors the size and the free bit of ptr in the header of the block after it
+    void SetTags(MallocMetadata* ptr)
+    {
+        MallocMetadata* next=NextBlock(ptr);
+        //next may be allocated and read by IsMmapped in another thread, the word is stored atomically
+        if(IsBlockFree(ptr))
+        {
+            next->prev_size=BlockSize(ptr);
+            __atomic_store_n(&next->size,next->size | PREV_FREE_BIT,__ATOMIC_RELAXED);
+        }
+        else
+            __atomic_store_n(&next->size,next->size & ~(size_t)PREV_FREE_BIT,__ATOMIC_RELAXED);
+    }
+
+    MallocMetadata* NextBlock(MallocMetadata* ptr)
+    {
+        return (MallocMetadata*)((long)ptr+BlockSize(ptr));
+    }
+
+    MallocMetadata* PrevBlock(MallocMetadata* ptr)//valid only when the previous block is free
+    {
+        return (MallocMetadata*)((long)ptr-ptr->prev_size);
+    }
+
+    bool IsPrevFree(MallocMetadata* ptr)
+    {
+        return ptr->size & PREV_FREE_BIT;
+    }
+
+    bool IsNextFree(MallocMetadata* ptr)
+    {
+        return IsBlockFree(NextBlock(ptr));
+    }
+
+    //bump allocation: the newest segment grows in place as long as it has room
+    bool CanExtendHeap(size_t increment)
+    {
+        return heap_end!=NULL && (char*)heap_end+META_DATA_SIZE+increment<=heap_limit;
+    }
+
+    //hands the never used end of the newest segment to the histogram before a new segment replaces it
+    void RetireSegmentEnd()
+    {
+        if(heap_end==NULL || (size_t)(heap_limit-(char*)heap_end)<MIN_BLOCK_SIZE+META_DATA_SIZE)
+            return;
+        MallocMetadata* ptr=heap_end;
+        SetSize(ptr,heap_limit-(char*)heap_end-META_DATA_SIZE);
+        CounterAdd(&heap_blocks,1);
+        CounterAdd(&heap_bytes,BlockSize(ptr));
+        ptr->size|=FREE_BIT | RELEASED_BIT; //never touched, so never committed
+        SetHeapEnd(ptr);
+        InsertToHisto(ptr);
+        if(IsPrevFree(ptr))
+            Merge(PrevBlock(ptr),true,false);
+    }
+
+    //a new segment with room for one block of real_size bytes
+    HeapRun* NewRun(size_t real_size)
+    {
+        if(FIRST_BLOCK_OFFSET+real_size+META_DATA_SIZE>SEGMENT_SIZE)
+            return NULL;
+        HeapRun* run=MapSegment();
+        if(run==NULL)
+            return NULL;
+        RetireSegmentEnd();
+        heap_limit=(char*)run+SEGMENT_SIZE;
+        heap_clean=(char*)run+FIRST_BLOCK_OFFSET;
+        run->next=runs;
+        run->arena=this;
+        runs=run;
+        return run;
+    }
+
+    bool IsLast(MallocMetadata* ptr)
+    {
+        return NextBlock(ptr)==heap_end;
+    }
+
+    MallocMetadata* Wilderness()
+    {
+        if(heap_end!=NULL && IsPrevFree(heap_end))
+            return PrevBlock(heap_end);
+        return NULL;
+    }
+
+    /**
+     * Hands the whole pages between begin and end back to the OS. They stay mapped and read as zeros
+     * once touched again. MADV_FREE would be cheaper but leaves the pages resident until memory pressure.
+     */
+    size_t ReleasePages(char* begin,char* end)
+    {
+        begin=(char*)(((unsigned long)begin+ReleaseUnit()-1) & ~(ReleaseUnit()-1));
+        end=(char*)((unsigned long)end & ~(ReleaseUnit()-1));
+        if(begin>=end)
+            return 0;
+        PROFILE_COUNT(PROFILE_MADVISE);
+        if(madvise(begin,end-begin,RELEASE_ADVICE)!=0)
+            return 0;
+        CounterAdd(&released_bytes,end-begin);
+        return end-begin;
+    }
+
+    //the links of a free block stay, everything after them can go
+    size_t ReleaseFreeBlock(MallocMetadata* ptr)
+    {
+        if(ptr->size & RELEASED_BIT)
+            return 0;
+        ptr->size|=RELEASED_BIT;
+        return ReleasePages((char*)ptr+MIN_BLOCK_SIZE,(char*)NextBlock(ptr));
+    }
+
+    //gives a large free tail of the newest segment back to the bump area and the OS, like shrinking the break
+    size_t TrimWilderness()
+    {
+        MallocMetadata* free_tail=Wilderness();
+        if(free_tail==NULL || BlockSize(free_tail)<__atomic_load_n(&trim_threshold,__ATOMIC_RELAXED))
+            return 0;
+        char* end=(char*)heap_end+META_DATA_SIZE;
+        bool released=free_tail->size & RELEASED_BIT;
+        RemoveFromHisto(free_tail);
+        CounterSub(&heap_blocks,1);
+        CounterSub(&heap_bytes,BlockSize(free_tail));
+        heap_end=free_tail;
+        heap_end->size=0;
+        if(released)//only the links and the old sentinel are still resident
+            return 0;
+        char* begin=(char*)heap_end+META_DATA_SIZE;
+        size_t counter=ReleasePages(begin,end);
+        if(counter>0 && RELEASE_ADVICE==MADV_DONTNEED && heap_clean==end)
+        {
+            //the partial units at both ends are zeroed by hand, so the whole bump area is clean again
+            char* released_begin=(char*)(((unsigned long)begin+ReleaseUnit()-1) & ~(ReleaseUnit()-1));
+            char* released_end=(char*)((unsigned long)end & ~(ReleaseUnit()-1));
+            memset(begin,0,released_begin-begin);
+            memset(released_end,0,end-released_end);
+            heap_clean=begin;
+        }
+        return counter;
+    }
+
+    //moves the sentinel of the newest run right after ptr, which became the last block
+    void SetHeapEnd(MallocMetadata* ptr)
+    {
+        heap_end=NextBlock(ptr);
+        heap_end->size=0;
+        if(heap_clean<(char*)heap_end+META_DATA_SIZE)
+            heap_clean=(char*)heap_end+META_DATA_SIZE;
+        SetTags(ptr);
+    }
+
+    /**
+     * Two level segregated fit: the first level (row) is the power of two of the size and the second level
+     * splits every power of two to SL_INDEX_COUNT linear bins. Sizes below SMALL_BLOCK_SIZE all share
+     * the first row, eight bytes apart.
+     */
+    int IndexOfHisto(size_t size)//size without metaData
+    {
+        if(size<SMALL_BLOCK_SIZE)
+            return size/(SMALL_BLOCK_SIZE/SL_INDEX_COUNT);
+        int fl=63-__builtin_clzl(size);
+        if(fl>FL_INDEX_MAX)
+            return NUM_OF_BINS-1;
+        int sl=(size>>(fl-SL_INDEX_COUNT_LOG2))^SL_INDEX_COUNT;
+        return (fl-FL_INDEX_SHIFT+1)*SL_INDEX_COUNT+sl;
+    }
+
+    void InsertToHisto(MallocMetadata* ptr)
+    {
+        int i=IndexOfHisto(PayloadSize(ptr));
+        histogram[i].insertAtHistBegin(ptr);
+        CounterAdd(&free_blocks,1);
+        CounterAdd(&free_bytes,PayloadSize(ptr));
+        fl_bitmap|=1UL<<(i/SL_INDEX_COUNT);
+        sl_bitmap[i/SL_INDEX_COUNT]|=1U<<(i%SL_INDEX_COUNT);
+    }
+
+    void RemoveFromHisto(MallocMetadata* ptr)
+    {
+        int i=IndexOfHisto(PayloadSize(ptr));
+        histogram[i].removeHisto(ptr);
+        CounterSub(&free_blocks,1);
+        CounterSub(&free_bytes,PayloadSize(ptr));
+        if(histogram[i].isEmpty())
+        {
+            sl_bitmap[i/SL_INDEX_COUNT]&=~(1U<<(i%SL_INDEX_COUNT));
+            if(sl_bitmap[i/SL_INDEX_COUNT]==0)
+                fl_bitmap&=~(1UL<<(i/SL_INDEX_COUNT));
+        }
+    }
+
+    //best fit among the first BEST_FIT_PROBE blocks of a bin, bounded so the lookup stays constant time
+    MallocMetadata* BestInBin(int i,size_t size)//size without metaData
+    {
+        MallocMetadata* best=NULL;
+        MallocMetadata* ptr=histogram[i].first();
+        for(int k=0;ptr!=NULL && k<BEST_FIT_PROBE;k++)
+        {
+            if(PayloadSize(ptr)>=size && (best==NULL || ptr->size<best->size))
+                best=ptr;
+            ptr=ptr->histo_next;
+        }
+        return best;
+    }
+
+    MallocMetadata* FindInHisto(size_t size)//size without metaData
+    {
+        //the bin of the request itself may hold blocks which fit, try them first for a tighter fit
+        int i=IndexOfHisto(size);
+        if(sl_bitmap[i/SL_INDEX_COUNT] & (1U<<(i%SL_INDEX_COUNT)))
+        {
+            MallocMetadata* best=BestInBin(i,size);
+            if(best!=NULL)
+                return best;
+        }
+        //otherwise round the request up to the next bin, every block of a bin above it fits
+        size_t rounded=size;
+        if(size>=SMALL_BLOCK_SIZE)
+            rounded+=(1UL<<(63-__builtin_clzl(size)-SL_INDEX_COUNT_LOG2))-1;
+        i=IndexOfHisto(rounded);
+        int fl=i/SL_INDEX_COUNT;
+        unsigned int sl_map=sl_bitmap[fl] & (~0U<<(i%SL_INDEX_COUNT));
+        if(sl_map==0)
+        {
+            unsigned long fl_map= (fl+1<FL_INDEX_COUNT)? fl_bitmap & (~0UL<<(fl+1)) : 0;
+            if(fl_map==0)
+                return NULL;
+            fl=__builtin_ctzl(fl_map);
+            sl_map=sl_bitmap[fl];
+        }
+        return BestInBin(fl*SL_INDEX_COUNT+__builtin_ctz(sl_map),size);
+    }
+
+    void Split(MallocMetadata* ptr,size_t size)
+    {
+        MallocMetadata* md_new_free = (MallocMetadata*)((long)(ptr)+(long)(size));
+        md_new_free->size=(BlockSize(ptr)-size) | FREE_BIT;
+        SetSize(ptr,size);
+        CounterAdd(&heap_blocks,1);
+        PROFILE_COUNT(PROFILE_SPLIT);
+        SetTags(md_new_free);
+        InsertToHisto(md_new_free);
+        if(IsNextFree(md_new_free))
+            Merge(md_new_free,true,false);
+    }
+
+    void SplitIfLarge(MallocMetadata* ptr,size_t size)
+    {
+        if(BlockSize(ptr)-size>=MIN_SPLIT_SIZE+META_DATA_SIZE)
+            Split(ptr,size);
+    }
+
+    //bytes at the start of the payload of a block of real_size bytes at ptr which lie before heap_clean
+    size_t DirtyBytes(MallocMetadata* ptr,size_t real_size)
+    {
+        char* payload=(char*)PayloadOf(ptr);
+        if(heap_clean<=payload)
+            return 0;
+        size_t dirty=heap_clean-payload;
+        return (dirty<real_size-META_DATA_SIZE)? dirty : real_size-META_DATA_SIZE;
+    }
+
+    //grows the heap by a new allocated block of real_size bytes, dirty tells how much of its payload may hold old data
+    MallocMetadata* NewHeapBlock(size_t real_size,size_t* dirty)
+    {
+        MallocMetadata* meta_data_ptr;
+        PROFILE_COUNT(PROFILE_HEAP_EXTEND);
+        if(CanExtendHeap(real_size))//the new block takes the place of the sentinel, and its prev_size
+            meta_data_ptr=heap_end;
+        else//first block, or the newest segment is full
+        {
+            HeapRun* run=NewRun(real_size);
+            if(run==NULL)
+                return NULL;
+            meta_data_ptr=(MallocMetadata*)((long)run+FIRST_BLOCK_OFFSET);
+            meta_data_ptr->size=0;
+        }
+        if(dirty!=NULL)
+            *dirty=DirtyBytes(meta_data_ptr,real_size);
+        SetSize(meta_data_ptr,real_size);
+        SetHeapEnd(meta_data_ptr);
+        CounterAdd(&heap_blocks,1);
+        CounterAdd(&heap_bytes,real_size);
+        return meta_data_ptr;
+    }
+
+    /**
+     * A block with a mapping of its own. The header sits at the start of the mapping, unless the payload has
+     * to be aligned beyond sixteen bytes: then the header moves forward to the aligned payload, prev_size
+     * keeps its offset from the start of the mapping and the block takes the rest of the mapping.
+     * With small pages the whole pages before the header and after the payload are unmapped right away.
+     * A cached mapping may be longer than needed, the block then takes all of it so its header gives the
+     * length of the mapping back. A fresh mapping is all zeros, a cached one leaves the whole payload dirty.
+     */
+    static void* MmapAllocate(size_t size,size_t alignment,size_t* dirty=NULL)
+    {
+        bool aligned=alignment>META_DATA_SIZE;
+        size_t length=MmapLength(size+META_DATA_SIZE+(aligned? alignment : 0));
+        bool huge;
+        if(dirty!=NULL)
+            *dirty=0;
+        size_t needed=length;
+        char* mapping=(char*)(sMmapCache->Get(&length,&huge));
+        if(mapping==NULL)
+            mapping=(char*)(MapMemory(length, 0, &huge));
+        else if(dirty!=NULL)
+            *dirty=size;
+        if(mapping==(char*)(-1))
+                return NULL;
+        MallocMetadata* meta_data_ptr=(MallocMetadata*)mapping;
+        if(aligned)
+            meta_data_ptr=MetaDataOf((void*)(((unsigned long)mapping+META_DATA_SIZE+alignment-1) & ~(alignment-1)));
+        size_t offset=(char*)meta_data_ptr-mapping;
+        if(aligned && HUGEPAGE_MODE==HUGEPAGE_NONE)
+        {
+            size_t lead=offset & ~(PageSize()-1);
+            size_t tail=length-lead-AlignSizeToPage(offset-lead+size+META_DATA_SIZE);
+            if(lead>0)
+                UnmapMemory(mapping, lead);
+            if(tail>0)
+                UnmapMemory(mapping+length-tail, tail);
+            mapping+=lead;
+            offset-=lead;
+            length-=lead+tail;
+        }
+        meta_data_ptr->prev_size=offset | (huge? HUGE_MAPPING : 0);
+        meta_data_ptr->size=((aligned || length!=needed)? length-offset : size+META_DATA_SIZE) | MMAPPED_BIT;
+        if(huge)
+            __atomic_fetch_add(&huge_advised_bytes,length,__ATOMIC_RELAXED);
+        __atomic_fetch_add(&mmap_allocated_blocks,1,__ATOMIC_RELAXED);
+        __atomic_fetch_add(&mmap_allocated_bytes,PayloadSize(meta_data_ptr),__ATOMIC_RELAXED);
+        return PayloadOf(meta_data_ptr);
+    }
+
+    static char* MappingOf(MallocMetadata* ptr)
+    {
+        return (char*)ptr-(ptr->prev_size & ~(size_t)HUGE_MAPPING);
+    }
+
+    //dirty, when given, is set to how many bytes at the start of the payload may hold old data
+    void* BlockAllocate(size_t size,size_t* dirty=NULL)
+    {
+        if(size > __atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED))//gets a mapping of its own instead of a place in a segment
+            return MmapAllocate(size,MALLOC_ALIGNMENT,dirty);
+        return HeapAllocate(size,dirty);
+    }
+
+    /**
+     * Block whose payload is aligned to alignment, a power of two above eight. The heap block is padded so
+     * the aligned payload leaves room for a free block in front of it, which goes back to the histogram,
+     * and the padding left behind the payload is split off as usual.
+     */
+    void* BlockAllocateAligned(size_t alignment,size_t size)
+    {
+        //padding a heap block by more than a page wastes more than a mapping of its own, which loses whole pages
+        if(size+alignment > __atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED) || alignment>PageSize())
+            return MmapAllocate(size,alignment);
+        char* ptr=(char*)(HeapAllocate(size+alignment+MIN_BLOCK_SIZE));
+        if(ptr==NULL)
+            return NULL;
+        MallocMetadata* lead=MetaDataOf(ptr);
+        char* aligned=(char*)(((unsigned long)ptr+alignment-1) & ~(alignment-1));
+        if(aligned>ptr)
+        {
+            while((size_t)(aligned-ptr)<MIN_BLOCK_SIZE)
+                aligned+=alignment;
+            MallocMetadata* meta_data_ptr=MetaDataOf(aligned);
+            meta_data_ptr->size=BlockSize(lead)-(aligned-ptr);
+            SetSize(lead,aligned-ptr);
+            CounterAdd(&heap_blocks,1);
+            lead->size|=FREE_BIT;
+            SetTags(lead);
+            InsertToHisto(lead);
+            if(IsPrevFree(lead))
+                Merge(PrevBlock(lead),true,false);
+        }
+        SplitIfLarge(MetaDataOf(aligned),RealSize(size));
+        return aligned;
+    }
+
+    void* HeapAllocate(size_t size,size_t* dirty=NULL)
+    {
+        DrainRemoteFrees();
+        size_t real_size=RealSize(size);
+        MallocMetadata* ptr_to_allocate_at=FindInHisto(real_size-META_DATA_SIZE);
+        PROFILE_BIN(IndexOfHisto(real_size-META_DATA_SIZE),ptr_to_allocate_at!=NULL);
+        if(ptr_to_allocate_at==NULL)
+        {
+            MallocMetadata* free_tail = Wilderness();
+            //the probe of FindInHisto may pass over a wilderness which already fits, it is split like a block found
+            if(free_tail && BlockSize(free_tail)>=real_size)
+                ptr_to_allocate_at=free_tail;
+            else if(free_tail && CanExtendHeap(real_size - BlockSize(free_tail)))//enlarge the free tail instead of adding a new block after it
+            {
+                RemoveFromHisto(free_tail);
+                if(dirty!=NULL)
+                    *dirty=DirtyBytes(free_tail,real_size);
+                free_tail->size&=~(size_t)(FREE_BIT | RELEASED_BIT);
+                CounterAdd(&heap_bytes,real_size-BlockSize(free_tail));
+                PROFILE_COUNT(PROFILE_WILDERNESS_EXTEND);
+                SetSize(free_tail,real_size);
+                SetHeapEnd(free_tail);
+                return PayloadOf(free_tail);
+            }
+            else
+            {
+                MallocMetadata* meta_data_ptr=NewHeapBlock(real_size,dirty);
+                if(meta_data_ptr==NULL)
+                    return NULL;
+                return PayloadOf(meta_data_ptr);
+            }
+        }
+        //remove from histo list and update block isnt free
+        RemoveFromHisto(ptr_to_allocate_at);
+        bool released=ptr_to_allocate_at->size & RELEASED_BIT;
+        ptr_to_allocate_at->size&=~(size_t)(FREE_BIT | RELEASED_BIT);
+        SetTags(ptr_to_allocate_at);
+        SplitIfLarge(ptr_to_allocate_at, real_size);
+        if(released && IsNextFree(ptr_to_allocate_at))//the remainder was not touched
+            NextBlock(ptr_to_allocate_at)->size|=RELEASED_BIT;
+        if(dirty!=NULL)//released blocks keep links and merged headers between their zero pages
+            *dirty=PayloadSize(ptr_to_allocate_at);
+        return PayloadOf(ptr_to_allocate_at);
+    }
+
+    /**
+     * n blocks of size bytes carved one after the other out of a single heap block, so the histogram is
+     * searched and split once per chunk of blocks instead of once per block. A chunk is kept to what the heap
+     * serves as one block and halved when the heap cannot serve it.
+     * Returns how many blocks were allocated, fewer than n only when memory runs out.
+     */
+    size_t BlockAllocateBatch(size_t size,size_t n,void** out)
+    {
+        size_t done=0;
+        if(size > __atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED))
+        {
+            while(done<n && (out[done]=MmapAllocate(size,MALLOC_ALIGNMENT))!=NULL)
+                done++;
+            return done;
+        }
+        size_t real_size=RealSize(size);
+        size_t chunk= (real_size<MMAP_THRESHOLD_MAX)? MMAP_THRESHOLD_MAX/real_size : 1;
+        while(done<n)
+        {
+            size_t count= (n-done<chunk)? n-done : chunk;
+            void* ptr=HeapAllocate(count*real_size-META_DATA_SIZE);
+            if(ptr==NULL)
+            {
+                if(count==1)
+                    break;
+                chunk=count/2;
+                continue;
+            }
+            MallocMetadata* meta_data_ptr=MetaDataOf(ptr);
+            size_t rest=BlockSize(meta_data_ptr);
+            for(size_t i=1;i<count;i++)//the last block keeps what the split left over
+            {
+                out[done++]=PayloadOf(meta_data_ptr);
+                SetSize(meta_data_ptr,real_size);
+                rest-=real_size;
+                meta_data_ptr=NextBlock(meta_data_ptr);
+                meta_data_ptr->size=rest;
+                CounterAdd(&heap_blocks,1);
+            }
+            out[done++]=PayloadOf(meta_data_ptr);
+        }
+        return done;
+    }
+
+    /**
+     * Frees blocks of this arena given in ascending address order and without duplicates. Blocks lying
+     * next to each other are united first, so a run of them is merged and inserted to the histogram once.
+     */
+    void FreeSortedBlocks(void** ptrs,size_t n)
+    {
+        size_t i=0;
+        while(i<n)
+        {
+            MallocMetadata* first=MetaDataOf(ptrs[i++]);
+            if(IsBlockFree(first))//double free
+                continue;
+            while(i<n && MetaDataOf(ptrs[i])==NextBlock(first) && !IsBlockFree(MetaDataOf(ptrs[i])))
+            {
+                SetSize(first,BlockSize(first)+BlockSize(MetaDataOf(ptrs[i++])));
+                CounterSub(&heap_blocks,1);
+            }
+            FreeBlock(PayloadOf(first));
+        }
+    }
+
+    //mmap blocks belong to no arena and need no lock
+    /**
+     * Resizes an mmap block without copying it: growing lets the kernel move the page tables with mremap,
+     * shrinking unmaps the pages past the new end and leaves the block where it is.
+     * MAP_HUGETLB mappings cannot be resized on every kernel, for them NULL asks the caller to copy.
+     */
+    static MallocMetadata* RemapMmapBlock(MallocMetadata* ptr,size_t size)
+    {
+        char* mapping=MappingOf(ptr);
+        size_t offset=(char*)ptr-mapping;
+        size_t old_length=MmapLength(offset+BlockSize(ptr));
+        size_t new_length=MmapLength(offset+size+META_DATA_SIZE);
+        size_t old_size=PayloadSize(ptr);
+        bool huge=ptr->prev_size & HUGE_MAPPING;
+        if(HUGEPAGE_MODE==HUGEPAGE_EXPLICIT && huge && new_length!=old_length)
+            return NULL;
+        if(new_length>old_length)
+        {
+            PROFILE_COUNT(PROFILE_MREMAP);
+            mapping=(char*)(mremap(mapping, old_length, new_length, MREMAP_MAYMOVE));
+            if(mapping==(char*)(-1))
+                return NULL;
+            ptr=(MallocMetadata*)(mapping+offset);
+        }
+        else if(new_length<old_length)
+            UnmapMemory(mapping+new_length, old_length-new_length);
+        ptr->size=(size+META_DATA_SIZE) | MMAPPED_BIT;
+        if(huge)
+        {
+            __atomic_fetch_sub(&huge_advised_bytes,old_length,__ATOMIC_RELAXED);
+            __atomic_fetch_add(&huge_advised_bytes,new_length,__ATOMIC_RELAXED);
+        }
+        else if(HUGEPAGE_MODE==HUGEPAGE_TRANSPARENT && new_length>=HUGE_PAGE_SIZE && madvise(mapping,new_length,MADV_HUGEPAGE)==0)
+        {
+            ptr->prev_size|=HUGE_MAPPING;
+            __atomic_fetch_add(&huge_advised_bytes,new_length,__ATOMIC_RELAXED);
+        }
+        __atomic_fetch_sub(&mmap_allocated_bytes,old_size,__ATOMIC_RELAXED);
+        __atomic_fetch_add(&mmap_allocated_bytes,size,__ATOMIC_RELAXED);
+        return ptr;
+    }
+
+    /**
+     * Freeing an mmap block larger than the threshold raises the threshold to its size, as glibc does:
+     * a block of that size which is freed is likely to be requested again, and the heap serves it without
+     * system calls. The wilderness is trimmed only above twice the threshold so it keeps room for such blocks.
+     */
+    static void UpdateMmapThreshold(size_t size)
+    {
+        size_t threshold=__atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED);
+        while(size>threshold && size<=MMAP_THRESHOLD_MAX)
+        {
+            if(__atomic_compare_exchange_n(&mmap_threshold,&threshold,size,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+            {
+                __atomic_store_n(&trim_threshold,2*size,__ATOMIC_RELAXED);
+                __atomic_fetch_add(&mmap_threshold_updates,1,__ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+
+    static void FreeMmapBlock(MallocMetadata* md_to_free)
+    {
+        UpdateMmapThreshold(PayloadSize(md_to_free));
+        __atomic_fetch_sub(&mmap_allocated_blocks,1,__ATOMIC_RELAXED);
+        __atomic_fetch_sub(&mmap_allocated_bytes,PayloadSize(md_to_free),__ATOMIC_RELAXED);
+        char* mapping=MappingOf(md_to_free);
+        size_t length=MmapLength((char*)md_to_free-mapping+BlockSize(md_to_free));
+        bool huge=md_to_free->prev_size & HUGE_MAPPING;
+        if(huge)
+            __atomic_fetch_sub(&huge_advised_bytes,length,__ATOMIC_RELAXED);
+        if(!sMmapCache->Put(mapping, length, huge))
+            UnmapMemory(mapping, length);
+    }
+
+    void FreeBlock(void* addrs)
+    {
+        MallocMetadata* md_to_free=MetaDataOf(addrs);
+        if(IsMmapped(md_to_free)) //this block is of mmap, should use unmap
+        {
+            FreeMmapBlock(md_to_free);
+            return;
+        }
+        else{ //should regular free
+            if (IsBlockFree(md_to_free))
+                return;
+            char* begin=(char*)md_to_free;
+            char* end=(char*)NextBlock(md_to_free);
+            bool released=true; //the free neighbours merged into the block were already released
+            md_to_free->size|=FREE_BIT;
+            SetTags(md_to_free);
+            InsertToHisto(md_to_free);
+            if(IsPrevFree(md_to_free))
+            {
+                released=PrevBlock(md_to_free)->size & RELEASED_BIT;
+                md_to_free=Merge(PrevBlock(md_to_free),true,false);
+            }
+            if(IsNextFree(md_to_free))
+            {
+                released=released && (NextBlock(md_to_free)->size & RELEASED_BIT);
+                md_to_free=Merge(md_to_free,true,false);
+            }
+            //blocks the size of those the heap serves instead of mmap are about to be reused, keep them resident
+            size_t release_threshold=__atomic_load_n(&trim_threshold,__ATOMIC_RELAXED);
+            if(release_threshold<RELEASE_THRESHOLD)
+                release_threshold=RELEASE_THRESHOLD;
+            if(BlockSize(md_to_free)>=release_threshold && released)//only the pages just freed, the rest had its turn
+            {
+                //the pages shared with the merged neighbours go too, they were kept only for the freed block
+                begin=(char*)((unsigned long)begin & ~(ReleaseUnit()-1));
+                end=(char*)(((unsigned long)end+ReleaseUnit()-1) & ~(ReleaseUnit()-1));
+                if(begin<(char*)md_to_free+MIN_BLOCK_SIZE)
+                    begin=(char*)md_to_free+MIN_BLOCK_SIZE;
+                if(end>(char*)NextBlock(md_to_free))
+                    end=(char*)NextBlock(md_to_free);
+                ReleasePages(begin,end);
+                md_to_free->size|=RELEASED_BIT;
+            }
+            else if(BlockSize(md_to_free)>=release_threshold)
+                ReleaseFreeBlock(md_to_free);
+            if(IsLast(md_to_free))
+                TrimWilderness();
+        }
+    }
+
+    /**
+     * Unites first_block with the block right after it.
+     * free - both blocks are free and so is the result. Otherwise the result is allocated,
+     * and mirror tells which of the two blocks was the free one (false - first, true - second).
+     */
+    MallocMetadata* Merge(MallocMetadata* first_block,bool free, bool mirror)    
+    {
+        MallocMetadata* second_block=NextBlock(first_block);
+        MallocMetadata* md_to_free= mirror? second_block: first_block;
+        RemoveFromHisto(md_to_free);
+        if(free)
+            RemoveFromHisto(second_block);
+        SetSize(first_block,BlockSize(first_block)+BlockSize(second_block));
+        CounterSub(&heap_blocks,1);
+        PROFILE_COUNT(PROFILE_MERGE);
+        first_block->size&=~(size_t)RELEASED_BIT;
+        if(free)
+            InsertToHisto(first_block);
+        else
+            first_block->size&=~(size_t)FREE_BIT;
+        SetTags(first_block);
+        return first_block;
+    }
+
+
+
+    void* Rellocate(void* oldp,size_t size)
+    {
+        MallocMetadata* md_to_realloc=MetaDataOf(oldp);
+        if(IsMmapped(md_to_realloc)) //should use mmap
+        {
+            if(size == PayloadSize(md_to_realloc))
+                return oldp;
+            MallocMetadata* meta_data_ptr=RemapMmapBlock(md_to_realloc,size);
+            if(meta_data_ptr!=NULL)
+                return PayloadOf(meta_data_ptr);
+            void* ptr=BlockAllocate(size);
+            if(ptr==NULL)
+                return NULL;
+            memmove(ptr,oldp,(size<PayloadSize(md_to_realloc))? size : PayloadSize(md_to_realloc));
+            FreeMmapBlock(md_to_realloc);
+            return ptr;
+        }
+        size_t real_size=RealSize(size);
+        size_t old_size = PayloadSize(md_to_realloc);
+        MallocMetadata* prev= IsPrevFree(md_to_realloc)? PrevBlock(md_to_realloc) : NULL;
+        MallocMetadata* next= IsNextFree(md_to_realloc)? NextBlock(md_to_realloc) : NULL;
+        if(BlockSize(md_to_realloc) >= real_size)
+        {
+            SplitIfLarge(md_to_realloc, real_size);
+            return oldp;
+        }
+        else if(prev!=NULL && BlockSize(md_to_realloc)+BlockSize(prev) >= real_size)
+        {
+            //the data has to move before the split writes a header over it
+            md_to_realloc=Merge(prev,false,false);
+            memmove(PayloadOf(md_to_realloc),oldp,old_size);
+            SplitIfLarge(md_to_realloc, real_size);
+            return PayloadOf(md_to_realloc);
+        }
+        else if(next!=NULL && BlockSize(md_to_realloc)+BlockSize(next) >= real_size)
+        {
+            md_to_realloc=Merge(md_to_realloc,false,true);
+            SplitIfLarge(md_to_realloc, real_size);
+            return oldp;
+        }
+        else if(prev!=NULL && next!=NULL && BlockSize(md_to_realloc)+BlockSize(next)+BlockSize(prev) >= real_size)
+        {
+            md_to_realloc=Merge(prev,false,false);
+            md_to_realloc=Merge(md_to_realloc,false,true);
+            memmove(PayloadOf(md_to_realloc),oldp,old_size);
+            SplitIfLarge(md_to_realloc, real_size);
+            return PayloadOf(md_to_realloc);
+        }
+
+        if (IsLast(md_to_realloc) && CanExtendHeap(real_size - BlockSize(md_to_realloc)))//Wildrness on itself
+        {
+            CounterAdd(&heap_bytes,real_size-BlockSize(md_to_realloc));
+            PROFILE_COUNT(PROFILE_WILDERNESS_EXTEND);
+            SetSize(md_to_realloc,real_size);
+            SetHeapEnd(md_to_realloc);
+            return oldp;
+        }
+        void* ptr = BlockAllocate(size);
+        if (!ptr)
+            return NULL;
+        else
+        {
+            memmove(ptr,oldp,old_size);
+            FreeBlock(oldp);
+            return ptr;
+        }
+    }
+
+
+    //kept up to date by every split, merge and growth of the heap, so reading them is constant time and lock free
+    //the blocks waiting in remote_free are free already, they are not merged with their neighbours yet
+    size_t numFreeBlocks()
+    {
+        return CounterRead(&free_blocks)+__atomic_load_n(&remote_blocks,__ATOMIC_RELAXED);
+    }
+
+    size_t numFreeBytes()
+    {
+        return CounterRead(&free_bytes)+__atomic_load_n(&remote_bytes,__ATOMIC_RELAXED);
+    }
+
+    size_t numAllocatedBlocks()
+    {
+        return CounterRead(&heap_blocks);
+    }
+
+    size_t numAllocatedBytes()
+    {
+        size_t blocks=CounterRead(&heap_blocks);
+        return CounterRead(&heap_bytes)-blocks*META_DATA_SIZE;
+    }
+
+    size_t numMetaDataBytes()
+    {
+        return CounterRead(&heap_blocks)*META_DATA_SIZE;
+    }
+
+    static size_t numMmapBlocks()
+    {
+        return __atomic_load_n(&mmap_allocated_blocks,__ATOMIC_RELAXED);
+    }
+
+    static size_t numMmapBytes()
+    {
+        return __atomic_load_n(&mmap_allocated_bytes,__ATOMIC_RELAXED);
+    }
+
+    size_t numMetaData()
+    {
+        return META_DATA_SIZE;
+    }
+
+    size_t numReleasedBytes()
+    {
+        return CounterRead(&released_bytes);
+    }
+
+    //found through the bitmaps: the largest block sits in the highest non empty bin
+    size_t LargestFreeBlock()
+    {
+        if(fl_bitmap==0)
+            return 0;
+        int fl=63-__builtin_clzl(fl_bitmap);
+        int i=fl*SL_INDEX_COUNT+31-__builtin_clz(sl_bitmap[fl]);
+        size_t largest=0;
+        for(MallocMetadata* ptr=histogram[i].first();ptr!=NULL;ptr=ptr->histo_next)
+            if(PayloadSize(ptr)>largest)
+                largest=PayloadSize(ptr);
+        return largest;
+    }
+
+    /**
+     * Writes a line per segment and per block of the arena, in address order within a segment, and adds the
+     * blocks up in snapshot. Callers must hold the lock. Sizes are payload sizes, the bin of a free block is
+     * its bin in the histogram and -1 for the others.
+     */
+    void DumpHeap(unsigned int index,SnapshotWriter* out,HeapSnapshot* snapshot)
+    {
+        for(HeapRun* run=runs;run!=NULL;run=run->next)
+        {
+            out->Printf("{\"type\":\"segment\",\"arena\":%u,\"addr\":%lu,\"size\":%lu}\n",index,(unsigned long)run,(unsigned long)SEGMENT_SIZE);
+            snapshot->segments++;
+            MallocMetadata* ptr=(MallocMetadata*)((long)run+FIRST_BLOCK_OFFSET);
+            for(;BlockSize(ptr)!=0;ptr=NextBlock(ptr))
+            {
+                size_t size=PayloadSize(ptr);
+                const char* state="used";
+                int bin=-1;
+                if(IsBlockFree(ptr))
+                {
+                    state= (ptr->size & RELEASED_BIT)? "released" : "free";
+                    bin=IndexOfHisto(size);
+                    snapshot->free_blocks++;
+                    snapshot->free_bytes+=size;
+                    snapshot->free_sizes[63-__builtin_clzl(size | 1)]++;
+                    if(size>snapshot->largest_free)
+                        snapshot->largest_free=size;
+                    if(ptr->size & RELEASED_BIT)
+                        snapshot->released_blocks++;
+                }
+                else
+                {
+                    snapshot->used_blocks++;
+                    snapshot->used_bytes+=size;
+                }
+                out->Printf("{\"type\":\"block\",\"arena\":%u,\"addr\":%lu,\"size\":%zu,\"state\":\"%s\",\"bin\":%d}\n",
+                            index,(unsigned long)PayloadOf(ptr),size,state,bin);
+            }
+        }
+    }
+
+    static size_t MmapThreshold()
+    {
+        return __atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED);
+    }
+
+    static size_t numHugeAdvisedBytes()
+    {
+        return __atomic_load_n(&huge_advised_bytes,__ATOMIC_RELAXED);
+    }
+
+    static size_t numMmapThresholdUpdates()
+    {
+        return __atomic_load_n(&mmap_threshold_updates,__ATOMIC_RELAXED);
+    }
+
+    //trims the wilderness and releases the inner pages of every free block, returns the bytes released
+    size_t Trim()
+    {
+        size_t counter=TrimWilderness();
+        for(int i=0;i<NUM_OF_BINS;i++)
+            for(MallocMetadata* ptr=histogram[i].first();ptr!=NULL;ptr=ptr->histo_next)
+                if(BlockSize(ptr)>=2*ReleaseUnit())
+                    counter+=ReleaseFreeBlock(ptr);
+        return counter;
+    }
+        
+};
+
+size_t BlockManager::mmap_allocated_blocks=0;
+size_t BlockManager::mmap_allocated_bytes=0;
+size_t BlockManager::mmap_threshold=MMAP_ALLOCATION_MIN_SIZE;
+size_t BlockManager::trim_threshold=TRIM_THRESHOLD;
+size_t BlockManager::mmap_threshold_updates=0;
+size_t BlockManager::huge_advised_bytes=0;
+BlockManager* BlockManager::arenas[MAX_ARENAS];
+unsigned int BlockManager::next_arena=0;
+pthread_mutex_t BlockManager::arenas_lock=PTHREAD_MUTEX_INITIALIZER;
+THREAD_LOCAL BlockManager* BlockManager::current=NULL;
+
+
+/**
+ *Header at the beginning of every slab span. A span is SLAB_SPAN_SIZE bytes carved into equal slots of one size class,
+ *slots carry no metadata of their own. Freed slots are linked through their first word, never used slots
+ *are handed out from the bump area at the end of the span. The bitmap marks the allocated slots.
+ */
+typedef struct SlabSpan{
+    struct SlabSpan* next;
+    struct SlabSpan* prev;
+    void* free_list;
+    size_t carved;
+    size_t used;
+    int size_class;
+    bool in_partial;
+    bool released; //empty span whose pages were handed back to the OS
+    bool sampled_overflow; //more slots were sampled than sampled holds, set until none is left
+    unsigned short num_sampled; //slots recorded by the heap sampler
+    unsigned short sampled[SLAB_SAMPLED_SLOTS]; //their offsets in SLAB_MIN_SLOT_SIZE units
+    unsigned long bitmap[SLAB_SPAN_SIZE/SLAB_MIN_SLOT_SIZE/64];
+}SlabSpan;
+
+#define SLAB_HEADER_SIZE ((sizeof(SlabSpan)+63)/64*64)
+
+/**
+ * Segregated size class allocator for requests up to SLAB_MAX_SIZE.
+ * Spans are taken from one big virtual region reserved up front, so telling a slab slot from a
+ * heap block is a range check and finding the span of a slot is a mask of its address.
+ * Requests which do not fit (the region is exhausted) fall through to the BlockManager.
+ */
+class SlabAllocator
+{
+    private:
+    SlabSpan* partial[SLAB_NUM_CLASSES]; //spans with at least one available slot
+    SlabSpan* free_spans; //empty spans ready to be reused by any class
+    char* region_begin;
+    char* region_top;
+    char* region_end;
+    unsigned char class_of[SLAB_MAX_SIZE/8+1];
+    size_t carved_blocks;
+    size_t carved_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t num_spans;
+    size_t released_bytes;
+    pthread_mutex_t lock;
+
+    SlabAllocator() :free_spans(NULL), region_begin(NULL), region_top(NULL), region_end(NULL), carved_blocks(0),
+                     carved_bytes(0), free_blocks(0), free_bytes(0), num_spans(0), released_bytes(0)
+    {
+        int c=0;
+        for(int i=0;i<SLAB_NUM_CLASSES;i++)
+            partial[i]=NULL;
+        for(size_t i=0;i<=SLAB_MAX_SIZE/8;i++)
+        {
+            //classes whose slots are not all aligned to MALLOC_ALIGNMENT are never handed out by size
+            while(ClassSize(c)<i*8 || ClassSize(c)%MALLOC_ALIGNMENT!=0)
+                c++;
+            class_of[i]=c;
+        }
+        pthread_mutex_init(&lock,NULL);
+    }
+
+    void ReserveRegion()
+    {
+        char* ptr=(char*)(mmap(NULL, SLAB_REGION_SIZE+SLAB_SPAN_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+        if(ptr==(char*)(-1))
+            return;
+        //spans are aligned to their size, so the span of a slot is found by masking its address
+        ptr=(char*)(((unsigned long)ptr+SLAB_SPAN_SIZE-1) & ~((unsigned long)SLAB_SPAN_SIZE-1));
+        region_top=ptr;
+        region_end=ptr+SLAB_REGION_SIZE;
+        __atomic_store_n(&region_begin,ptr,__ATOMIC_RELEASE);
+    }
+
+    void InsertPartial(SlabSpan* span)
+    {
+        span->prev=NULL;
+        span->next=partial[span->size_class];
+        if(span->next!=NULL)
+            span->next->prev=span;
+        partial[span->size_class]=span;
+        span->in_partial=true;
+    }
+
+    void RemovePartial(SlabSpan* span)
+    {
+        if(span->prev!=NULL)
+            span->prev->next=span->next;
+        else
+            partial[span->size_class]=span->next;
+        if(span->next!=NULL)
+            span->next->prev=span->prev;
+        span->in_partial=false;
+    }
+
+    SlabSpan* NewSpan(int size_class)
+    {
+        SlabSpan* span=free_spans;
+        if(span!=NULL)
+            free_spans=span->next;
+        else
+        {
+            if(region_begin==NULL)
+                ReserveRegion();
+            if(region_top==region_end)
+                return NULL;
+            span=(SlabSpan*)region_top;
+            if(mprotect(span, SLAB_SPAN_SIZE, PROT_READ | PROT_WRITE)!=0)
+                return NULL;
+            region_top+=SLAB_SPAN_SIZE;
+        }
+        memset(span,0,SLAB_HEADER_SIZE);
+        span->size_class=size_class;
+        CounterAdd(&num_spans,1);
+        InsertPartial(span);
+        return span;
+    }
+
+    void ReleaseSpan(SlabSpan* span)
+    {
+        size_t size=ClassSize(span->size_class);
+        RemovePartial(span);
+        CounterSub(&carved_blocks,span->carved);
+        CounterSub(&carved_bytes,span->carved*size);
+        CounterSub(&free_blocks,span->carved);
+        CounterSub(&free_bytes,span->carved*size);
+        CounterSub(&num_spans,1);
+        span->next=free_spans;
+        free_spans=span;
+    }
+
+    size_t Capacity(int size_class)
+    {
+        return (SLAB_SPAN_SIZE-SLAB_HEADER_SIZE)/ClassSize(size_class);
+    }
+
+    public:
+
+    static SlabAllocator* instance()
+    {
+        static SlabAllocator instance;
+        return &instance;
+    }
+
+    void Lock()
+    {
+        pthread_mutex_lock(&lock);
+    }
+
+    void Unlock()
+    {
+        pthread_mutex_unlock(&lock);
+    }
+
+    bool Contains(void* ptr)
+    {
+        char* begin=__atomic_load_n(&region_begin,__ATOMIC_ACQUIRE);
+        return (begin!=NULL && (char*)ptr>=begin && (char*)ptr<begin+SLAB_REGION_SIZE);
+    }
+
+    static size_t ClassSize(int size_class)
+    {
+        //16 bytes steps up to 128, then four classes per power of two
+        if(size_class<8)
+            return (size_class+1)*16;
+        return (size_t)(128+32*(((size_class-8)&3)+1)) << ((size_class-8)/4);
+    }
+
+    int IndexOfClass(size_t size)//size aligned to eight, at most SLAB_MAX_SIZE
+    {
+        return class_of[size/8];
+    }
+
+    /**
+     * The class of size if its slots are all aligned to alignment, -1 if they are not. Spans are aligned
+     * and their header takes SLAB_HEADER_SIZE bytes, so when both the header and the slot size are multiples
+     * of the alignment every slot is aligned. A larger class is never taken: sfree_sized finds the class
+     * of a slot from its size alone.
+     */
+    int IndexOfAlignedClass(size_t size,size_t alignment)//size aligned to eight, at most SLAB_MAX_SIZE
+    {
+        int size_class=IndexOfClass(size);
+        if(SLAB_HEADER_SIZE%alignment!=0 || ClassSize(size_class)%alignment!=0)
+            return -1;
+        return size_class;
+    }
+
+    SlabSpan* SpanOf(void* ptr)
+    {
+        return (SlabSpan*)((unsigned long)ptr & ~((unsigned long)SLAB_SPAN_SIZE-1));
+    }
+
+    void* Allocate(int size_class)
+    {
+        SlabSpan* span=partial[size_class];
+        if(span==NULL)
+            span=NewSpan(size_class);
+        if(span==NULL)
+            return NULL;
+        size_t size=ClassSize(size_class);
+        char* slot;
+        if(span->free_list!=NULL)
+        {
+            slot=(char*)span->free_list;
+            span->free_list=*(void**)slot;
+            CounterSub(&free_blocks,1);
+            CounterSub(&free_bytes,size);
+        }
+        else
+        {
+            slot=(char*)span+SLAB_HEADER_SIZE+span->carved*size;
+            span->carved++;
+            CounterAdd(&carved_blocks,1);
+            CounterAdd(&carved_bytes,size);
+        }
+        ((void**)slot)[1]=NULL; //the span mark Free left, or stale data of a reused span, would send sfree to IsFreed
+        size_t index=(slot-(char*)span-SLAB_HEADER_SIZE)/size;
+        span->bitmap[index/64]|=(1UL<<(index%64));
+        span->used++;
+        if(span->free_list==NULL && span->carved==Capacity(size_class))
+            RemovePartial(span);
+        return slot;
+    }
+
+    void Free(void* ptr)
+    {
+        SlabSpan* span=SpanOf(ptr);
+        size_t size=ClassSize(span->size_class);
+        size_t index=((char*)ptr-(char*)span-SLAB_HEADER_SIZE)/size;
+        if(!(span->bitmap[index/64] & (1UL<<(index%64))))//double free
+            return;
+        span->bitmap[index/64]&=~(1UL<<(index%64));
+        ((void**)ptr)[0]=span->free_list;
+        ((void**)ptr)[1]=(void*)span;
+        span->free_list=ptr;
+        span->used--;
+        CounterAdd(&free_blocks,1);
+        CounterAdd(&free_bytes,size);
+        if(!span->in_partial)
+            InsertPartial(span);
+        else if(span->used==0 && (span->prev!=NULL || span->next!=NULL))//keep the last span of the class around
+            ReleaseSpan(span);
+    }
+
+    //a slot in the free list of its span points back to the span with its second word
+    bool MaybeFree(void* ptr)
+    {
+        return ((void**)ptr)[1]==(void*)SpanOf(ptr);
+    }
+
+    bool IsFree(void* ptr)
+    {
+        SlabSpan* span=SpanOf(ptr);
+        size_t index=((char*)ptr-(char*)span-SLAB_HEADER_SIZE)/ClassSize(span->size_class);
+        return !(span->bitmap[index/64] & (1UL<<(index%64)));
+    }
+
+    size_t numFreeBlocks()
+    {
+        return CounterRead(&free_blocks);
+    }
+
+    size_t numFreeBytes()
+    {
+        return CounterRead(&free_bytes);
+    }
+
+    size_t numAllocatedBlocks()
+    {
+        return CounterRead(&carved_blocks);
+    }
+
+    size_t numAllocatedBytes()
+    {
+        return CounterRead(&carved_bytes);
+    }
+
+    size_t numMetaDataBytes()
+    {
+        return CounterRead(&num_spans)*SLAB_HEADER_SIZE;
+    }
+
+    size_t numReleasedBytes()
+    {
+        return CounterRead(&released_bytes);
+    }
+
+    //hands the pages of the empty spans back to the OS, the first page keeps the header and the free_spans link
+    size_t Trim()
+    {
+        size_t counter=0;
+        for(SlabSpan* span=free_spans;span!=NULL;span=span->next)
+        {
+            if(span->released)
+                continue;
+            PROFILE_COUNT(PROFILE_MADVISE);
+            if(madvise((char*)span+PageSize(),SLAB_SPAN_SIZE-PageSize(),RELEASE_ADVICE)==0)
+            {
+                span->released=true;
+                counter+=SLAB_SPAN_SIZE-PageSize();
+            }
+        }
+        CounterAdd(&released_bytes,counter);
+        return counter;
+    }
+
+    //a line per span carved from the region, slots held by the thread caches count as used
+    void Dump(SnapshotWriter* out)
+    {
+        for(char* ptr=region_begin;ptr!=NULL && ptr<region_top;ptr+=SLAB_SPAN_SIZE)
+        {
+            SlabSpan* span=(SlabSpan*)ptr;
+            const char* state= span->released? "released" : (span->used==0)? "empty" : span->in_partial? "partial" : "full";
+            out->Printf("{\"type\":\"span\",\"addr\":%lu,\"size\":%lu,\"slot_size\":%zu,\"used\":%zu,\"carved\":%zu,\"state\":\"%s\"}\n",
+                        (unsigned long)span,(unsigned long)SLAB_SPAN_SIZE,ClassSize(span->size_class),span->used,span->carved,state);
+        }
+    }
+};
+
+
+/**
+ * Per thread cache of recently freed slab slots, one LIFO stack per size class.
+ * Cached slots are still allocated in the eyes of the SlabAllocator, so small smalloc/sfree calls are
+ * served without taking any lock. The cache refills from and flushes to the slabs TCACHE_BATCH slots at a time.
+ * The second word of a cached slot holds the cache key, which lets sfree spot a double free
+ * without touching the span.
+ */
+class ThreadCache{
+    private:
+    void* bins[SLAB_NUM_CLASSES];
+    size_t counts[SLAB_NUM_CLASSES];
+    size_t cached_blocks;
+    size_t cached_bytes;
+    ThreadCache* next;
+    ThreadCache* prev;
+
+    static ThreadCache* caches; //all live caches, protected by the SlabAllocator lock
+    static pthread_key_t key;
+    static pthread_once_t key_once;
+    static THREAD_LOCAL ThreadCache* current;
+
+    //the counters are read by other threads for the statistics, plain stores are enough
+    void UpdateCounters(int size_class,bool added)
+    {
+        size_t size=SlabAllocator::ClassSize(size_class);
+        size_t blocks= added? cached_blocks+1 : cached_blocks-1;
+        size_t bytes= added? cached_bytes+size : cached_bytes-size;
+        __atomic_store_n(&cached_blocks,blocks,__ATOMIC_RELAXED);
+        __atomic_store_n(&cached_bytes,bytes,__ATOMIC_RELAXED);
+    }
+
+    void Push(void* ptr,int size_class)
+    {
+        ((void**)ptr)[0]=bins[size_class];
+        ((void**)ptr)[1]=(void*)&key;
+        bins[size_class]=ptr;
+        counts[size_class]++;
+        UpdateCounters(size_class,true);
+    }
+
+    void* Pop(int size_class)
+    {
+        void* ptr=bins[size_class];
+        bins[size_class]=((void**)ptr)[0];
+        ((void**)ptr)[1]=NULL;
+        counts[size_class]--;
+        UpdateCounters(size_class,false);
+        return ptr;
+    }
+
+    bool IsFreed(void* ptr)
+    {
+        if(!sSlabAllocator->MaybeFree(ptr))
+            return false;
+        sSlabAllocator->Lock();
+        bool is_free=sSlabAllocator->IsFree(ptr);
+        sSlabAllocator->Unlock();
+        return is_free;
+    }
+
+    bool IsCached(void* ptr,int size_class)
+    {
+        if(((void**)ptr)[1]!=(void*)&key)
+            return false;
+        for(void* cached=bins[size_class];cached!=NULL;cached=((void**)cached)[0])
+            if(cached==ptr)
+                return true;
+        return false;
+    }
+
+    void* Refill(int size_class)
+    {
+        void* result;
+        sSlabAllocator->Lock();
+        result=sSlabAllocator->Allocate(size_class);
+        for(int k=1;result!=NULL && k<TCACHE_BATCH;k++)
+        {
+            void* ptr=sSlabAllocator->Allocate(size_class);
+            if(ptr==NULL)
+                break;
+            Push(ptr,size_class);
+        }
+        sSlabAllocator->Unlock();
+        return result;
+    }
+
+    void Flush(int size_class,size_t amount)
+    {
+        sSlabAllocator->Lock();
+        while(amount>0 && bins[size_class]!=NULL)
+        {
+            sSlabAllocator->Free(Pop(size_class));
+            amount--;
+        }
+        sSlabAllocator->Unlock();
+    }
+
+    static void CreateKey()
+    {
+        pthread_key_create(&key,Destroy);
+    }
+
+    //called on thread exit, gives all the cached slots back to the slabs
+    static void Destroy(void* arg)
+    {
+        ThreadCache* tcache=(ThreadCache*)arg;
+        for(int i=0;i<SLAB_NUM_CLASSES;i++)
+            tcache->Flush(i,tcache->counts[i]);
+        sSlabAllocator->Lock();
+        if(tcache->prev!=NULL)
+            tcache->prev->next=tcache->next;
+        else
+            caches=tcache->next;
+        if(tcache->next!=NULL)
+            tcache->next->prev=tcache->prev;
+        sSlabAllocator->Unlock();
+        current=NULL;
+        UnmapMemory(tcache,sizeof(ThreadCache));
+    }
+
+    public:
+
+    static ThreadCache* Get()
+    {
+        if(current!=NULL)
+            return current;
+        pthread_once(&key_once,CreateKey);
+        ThreadCache* tcache=(ThreadCache*)(mmap(NULL, sizeof(ThreadCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if(tcache==(ThreadCache*)(-1))
+            return NULL;
+        //fresh mmap memory is zeroed, so all the bins and counters are already empty
+        sSlabAllocator->Lock();
+        tcache->prev=NULL;
+        tcache->next=caches;
+        if(caches!=NULL)
+            caches->prev=tcache;
+        caches=tcache;
+        sSlabAllocator->Unlock();
+        pthread_setspecific(key,tcache);
+        current=tcache;
+        return tcache;
+    }
+
+    void* Allocate(int size_class)
+    {
+        if(bins[size_class]!=NULL)
+            return Pop(size_class);
+        return Refill(size_class);
+    }
+
+    void Free(void* ptr)
+    {
+        Free(ptr,sSlabAllocator->SpanOf(ptr)->size_class);
+    }
+
+    //size_class is known by the caller, so the span header is not read
+    void Free(void* ptr,int size_class)
+    {
+        if(IsCached(ptr,size_class) || IsFreed(ptr))//double free
+            return;
+        Push(ptr,size_class);
+        if(counts[size_class]>TCACHE_MAX_COUNT)
+            Flush(size_class,TCACHE_BATCH);
+    }
+
+    //gives slots straight back to the slabs under a single lock, the ones this cache holds are double frees
+    void FreeToSlabs(void** ptrs,size_t n)
+    {
+        sSlabAllocator->Lock();
+        for(size_t i=0;i<n;i++)
+            if(!IsCached(ptrs[i],sSlabAllocator->SpanOf(ptrs[i])->size_class))
+                sSlabAllocator->Free(ptrs[i]);
+        sSlabAllocator->Unlock();
+    }
+
+    //the per thread counters are summed under the SlabAllocator lock only to keep exiting caches on the list
+    static size_t numCachedBlocks()
+    {
+        size_t counter=0;
+        sSlabAllocator->Lock();
+        for(ThreadCache* ptr=caches;ptr!=NULL;ptr=ptr->next)
+            counter+=__atomic_load_n(&ptr->cached_blocks,__ATOMIC_RELAXED);
+        sSlabAllocator->Unlock();
+        return counter;
+    }
+
+    static size_t numCachedBytes()
+    {
+        size_t counter=0;
+        sSlabAllocator->Lock();
+        for(ThreadCache* ptr=caches;ptr!=NULL;ptr=ptr->next)
+            counter+=__atomic_load_n(&ptr->cached_bytes,__ATOMIC_RELAXED);
+        sSlabAllocator->Unlock();
+        return counter;
+    }
+};
+
+ThreadCache* ThreadCache::caches=NULL;
+pthread_key_t ThreadCache::key;
+pthread_once_t ThreadCache::key_once=PTHREAD_ONCE_INIT;
+THREAD_LOCAL ThreadCache* ThreadCache::current=NULL;
+
+
+/**
+ * Sampling heap profiler, compiled in with -DSMALLOC_HEAP_PROFILE. Like tcmalloc, every thread counts down the
+ * bytes it allocates from a distance drawn from an exponential distribution with mean heap_sample_rate, so the
+ * samples form a Poisson process over the allocated bytes and a block of size bytes is sampled with probability
+ * 1-exp(-size/rate). The allocation which crosses zero records its call stack in a table of the live samples,
+ * and freeing it removes the entry. _dump_heap_profile writes the table in the pprof heap format, which pprof
+ * scales back up by the rate. Without the flag the hooks expand to nothing, and with it the cost of an unsampled
+ * allocation is a thread local subtraction and of a free a look at the header of its span or segment.
+ */
+#ifdef SMALLOC_HEAP_PROFILE
+#ifndef HEAP_SAMPLE_RATE
+#define HEAP_SAMPLE_RATE (2*1024*1024) //mean bytes between samples as in tcmalloc, 0 disables the sampling
+#endif
+#define HEAP_SAMPLE_SLOTS_LOG2 13
+#define HEAP_SAMPLE_SLOTS (1<<HEAP_SAMPLE_SLOTS_LOG2) //the live samples kept at most, beyond that new samples are dropped
+#define HEAP_SAMPLE_PROBE 16 //slots probed for a pointer, so a free never scans a crowded table
+#define HEAP_SAMPLE_DEPTH 32 //frames kept of a call stack
+#define HEAP_SAMPLE_TOMBSTONE ((void*)1) //removed entry, the probe of a pointer goes on past it
+#define HEAP_SAMPLE_RECHECK (1L<<26) //bytes between two looks at the rate while the sampling is stopped
+
+typedef struct HeapSample{
+    void* ptr; //NULL for an empty slot, written last so a probing free sees a whole entry
+    size_t size; //requested bytes
+    int depth;
+    void* stack[HEAP_SAMPLE_DEPTH];
+}HeapSample;
+
+class HeapSampler
+{
+    private:
+    static HeapSample samples[HEAP_SAMPLE_SLOTS];
+    static size_t live_samples;
+    static size_t heap_sample_rate;
+    static pthread_mutex_t lock;
+    static THREAD_LOCAL long bytes_until_sample;
+    static THREAD_LOCAL unsigned long random_state; //0 until the thread draws its first distance
+    static THREAD_LOCAL unsigned int depth; //public calls made by public calls, or by the sampler, are not sampled
+
+    static size_t Slot(void* ptr)
+    {
+        return ((unsigned long)ptr>>4)*0x9E3779B97F4A7C15UL>>(64-HEAP_SAMPLE_SLOTS_LOG2);
+    }
+
+    //xorshift64*, good enough to draw distances and needs no lock and no allocation
+    static double Uniform()
+    {
+        if(random_state==0)
+            random_state=((unsigned long)&random_state ^ (unsigned long)time(NULL)*0x9E3779B97F4A7C15UL) | 1;
+        random_state^=random_state>>12;
+        random_state^=random_state<<25;
+        random_state^=random_state>>27;
+        return ((random_state*0x2545F4914F6CDD1DUL)>>11)*(1.0/9007199254740992.0);
+    }
+
+    static long NextDistance(size_t rate)
+    {
+        return (long)(-log(1.0-Uniform())*rate)+1; //1-u is in (0,1], the log is finite
+    }
+
+    static _Unwind_Reason_Code AddFrame(struct _Unwind_Context* context,void* arg)
+    {
+        HeapSample* sample=(HeapSample*)arg;
+        if(sample->depth>=HEAP_SAMPLE_DEPTH)
+            return _URC_END_OF_STACK;
+        void* ip=(void*)_Unwind_GetIP(context);
+        if(ip==NULL)
+            return _URC_END_OF_STACK;
+        if(sample->depth>=0)
+            sample->stack[sample->depth]=ip;
+        sample->depth++;
+        return _URC_NO_REASON;
+    }
+
+    static void Record(void* ptr,size_t size)
+    {
+        size_t rate=__atomic_load_n(&heap_sample_rate,__ATOMIC_RELAXED);
+        if(rate==0)
+        {
+            bytes_until_sample=HEAP_SAMPLE_RECHECK;
+            return;
+        }
+        bool first=(random_state==0);
+        bytes_until_sample=NextDistance(rate);
+        if(first)//the distance of a new thread starts now, the allocation that drew it is not sampled
+            return;
+        HeapSample sample;
+        sample.size=size;
+        sample.depth=-1; //the first frame is Record itself
+        depth++;
+        _Unwind_Backtrace(AddFrame,&sample);
+        depth--;
+        if(sample.depth<0)
+            sample.depth=0;
+        pthread_mutex_lock(&lock);
+        size_t slot=Slot(ptr);
+        for(int i=0;i<HEAP_SAMPLE_PROBE;i++,slot=(slot+1)%HEAP_SAMPLE_SLOTS)
+        {
+            void* current=samples[slot].ptr;
+            if(current!=NULL && current!=HEAP_SAMPLE_TOMBSTONE)
+                continue;
+            samples[slot].size=sample.size;
+            samples[slot].depth=sample.depth;
+            memcpy(samples[slot].stack,sample.stack,sample.depth*sizeof(void*));
+            __atomic_store_n(&samples[slot].ptr,ptr,__ATOMIC_RELEASE);
+            __atomic_fetch_add(&live_samples,1,__ATOMIC_RELAXED);
+            Mark(ptr,true);
+            break;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    static void Forget(void* ptr)
+    {
+        size_t slot=Slot(ptr);
+        for(int i=0;i<HEAP_SAMPLE_PROBE;i++,slot=(slot+1)%HEAP_SAMPLE_SLOTS)
+        {
+            void* current=__atomic_load_n(&samples[slot].ptr,__ATOMIC_ACQUIRE);
+            if(current==NULL)
+                return;
+            if(current==ptr)
+            {
+                //only the free of ptr removes its entry, the lock only orders it against inserts and dumps
+                pthread_mutex_lock(&lock);
+                __atomic_store_n(&samples[slot].ptr,HEAP_SAMPLE_TOMBSTONE,__ATOMIC_RELAXED);
+                __atomic_fetch_sub(&live_samples,1,__ATOMIC_RELAXED);
+                Mark(ptr,false);
+                pthread_mutex_unlock(&lock);
+                return;
+            }
+        }
+    }
+
+    /**
+     * Tells sfree whether ptr may be in the table, so most unsampled frees never touch it: a slab span keeps the
+     * offsets of its sampled slots and a heap segment counts its sampled blocks per HEAP_SAMPLE_REGION.
+     * Called under the lock of the sampler.
+     */
+    static void Mark(void* ptr,bool sampled)
+    {
+        if(sSlabAllocator->Contains(ptr))
+        {
+            SlabSpan* span=sSlabAllocator->SpanOf(ptr);
+            unsigned short offset=((char*)ptr-(char*)span)/SLAB_MIN_SLOT_SIZE;
+            unsigned short n=span->num_sampled;
+            if(sampled)
+            {
+                if(n<SLAB_SAMPLED_SLOTS && !span->sampled_overflow)
+                    span->sampled[n]=offset;
+                else
+                    __atomic_store_n(&span->sampled_overflow,true,__ATOMIC_RELAXED);
+                __atomic_store_n(&span->num_sampled,n+1,__ATOMIC_RELEASE);
+                return;
+            }
+            if(span->sampled_overflow)
+            {
+                __atomic_store_n(&span->num_sampled,n-1,__ATOMIC_RELAXED);
+                if(n==1)
+                    __atomic_store_n(&span->sampled_overflow,false,__ATOMIC_RELEASE);
+                return;
+            }
+            //the last offset moves into the hole before the count drops, so a reader always finds its own
+            for(int i=0;i<n;i++)
+            {
+                if(span->sampled[i]==offset)
+                {
+                    span->sampled[i]=span->sampled[n-1];
+                    break;
+                }
+            }
+            __atomic_store_n(&span->num_sampled,n-1,__ATOMIC_RELEASE);
+            return;
+        }
+        if(IsMmapped(MetaDataOf(ptr)))
+            return;
+        unsigned char* counter=RegionCounter(ptr);
+        if(*counter<255)
+            __atomic_store_n(counter,(unsigned char)(sampled? *counter+1 : *counter-1),__ATOMIC_RELAXED);
+    }
+
+    static unsigned char* RegionCounter(void* ptr)
+    {
+        HeapRun* run=(HeapRun*)((unsigned long)ptr & ~(SEGMENT_SIZE-1));
+        return &run->sampled[((char*)ptr-(char*)run)/HEAP_SAMPLE_REGION];
+    }
+
+    static bool IsMarked(void* ptr)
+    {
+        if(!sSlabAllocator->Contains(ptr))//mmap blocks are few and their free costs a munmap anyway
+            return IsMmapped(MetaDataOf(ptr)) || __atomic_load_n(RegionCounter(ptr),__ATOMIC_RELAXED)>0;
+        SlabSpan* span=sSlabAllocator->SpanOf(ptr);
+        if(__atomic_load_n(&span->sampled_overflow,__ATOMIC_ACQUIRE))
+            return true;
+        unsigned short n=__atomic_load_n(&span->num_sampled,__ATOMIC_ACQUIRE);
+        unsigned short offset=((char*)ptr-(char*)span)/SLAB_MIN_SLOT_SIZE;
+        for(int i=0;i<n;i++)
+            if(span->sampled[i]==offset)
+                return true;
+        return false;
+    }
+
+    public:
+
+    //marks a public call, only the outermost one samples
+    class Scope
+    {
+        public:
+        Scope()
+        {
+            depth++;
+        }
+        ~Scope()
+        {
+            depth--;
+        }
+    };
+
+    static void* Allocated(void* ptr,size_t size)
+    {
+        if(ptr!=NULL && depth==1 && (bytes_until_sample-=size)<0)
+            Record(ptr,size);
+        return ptr;
+    }
+
+    static void Freed(void* ptr)
+    {
+        if(depth==1 && ptr!=NULL && __atomic_load_n(&live_samples,__ATOMIC_RELAXED)>0 && IsMarked(ptr))
+            Forget(ptr);
+    }
+
+    static void SetRate(size_t rate)
+    {
+        __atomic_store_n(&heap_sample_rate,rate,__ATOMIC_RELAXED);
+    }
+
+    static void Lock()
+    {
+        pthread_mutex_lock(&lock);
+    }
+
+    static void Unlock()
+    {
+        pthread_mutex_unlock(&lock);
+    }
+
+    /**
+     * The legacy pprof heap profile: a header with the totals, a line per sample with its count, bytes and
+     * stack, and the memory map of the process so pprof can symbolize the addresses.
+     */
+    static void Dump(SnapshotWriter* out)
+    {
+        pthread_mutex_lock(&lock);
+        size_t count=0;
+        size_t bytes=0;
+        for(int i=0;i<HEAP_SAMPLE_SLOTS;i++)
+        {
+            if(samples[i].ptr==NULL || samples[i].ptr==HEAP_SAMPLE_TOMBSTONE)
+                continue;
+            count++;
+            bytes+=samples[i].size;
+        }
+        out->Printf("heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",count,bytes,count,bytes,heap_sample_rate);
+        for(int i=0;i<HEAP_SAMPLE_SLOTS;i++)
+        {
+            if(samples[i].ptr==NULL || samples[i].ptr==HEAP_SAMPLE_TOMBSTONE)
+                continue;
+            out->Printf("1: %zu [1: %zu] @",samples[i].size,samples[i].size);
+            for(int k=0;k<samples[i].depth;k++)
+                out->Printf(" %p",samples[i].stack[k]);
+            out->Printf("\n");
+        }
+        pthread_mutex_unlock(&lock);
+        out->Printf("\nMAPPED_LIBRARIES:\n");
+        int fd=open("/proc/self/maps",O_RDONLY);
+        if(fd<0)
+            return;
+        char buffer[4096];
+        ssize_t length;
+        while((length=read(fd,buffer,sizeof(buffer)))>0)
+            out->Write(buffer,length);
+        close(fd);
+    }
+};
+
+HeapSample HeapSampler::samples[HEAP_SAMPLE_SLOTS];
+size_t HeapSampler::live_samples=0;
+size_t HeapSampler::heap_sample_rate=HEAP_SAMPLE_RATE;
+pthread_mutex_t HeapSampler::lock=PTHREAD_MUTEX_INITIALIZER;
+THREAD_LOCAL long HeapSampler::bytes_until_sample=0;
+THREAD_LOCAL unsigned long HeapSampler::random_state=0;
+THREAD_LOCAL unsigned int HeapSampler::depth=0;
+
+#define HEAP_SAMPLE_SCOPE() HeapSampler::Scope heap_sample_scope
+#define HEAP_SAMPLE_ALLOC(ptr,size) HeapSampler::Allocated(ptr,size)
+#define HEAP_SAMPLE_FREE(ptr) HeapSampler::Freed(ptr)
+#else
+#define HEAP_SAMPLE_SCOPE()
+#define HEAP_SAMPLE_ALLOC(ptr,size) (ptr)
+#define HEAP_SAMPLE_FREE(ptr)
+#endif
+
+/**
+ * A fork while another thread holds one of the locks would leave it locked forever in the child, so every lock
+ * is taken before the fork and released on both sides, in the order the allocation paths take them.
+ */
+void PrepareFork()
+{
+#ifdef SMALLOC_HEAP_PROFILE
+    HeapSampler::Lock();
+#endif
+    BlockManager::LockAll();
+    sSlabAllocator->Lock();
+    sMmapCache->Lock();
+}
+
+void AfterFork()
+{
+    sMmapCache->Unlock();
+    sSlabAllocator->Unlock();
+    BlockManager::UnlockAll();
+#ifdef SMALLOC_HEAP_PROFILE
+    HeapSampler::Unlock();
+#endif
+}
+
+//runs when the library is loaded, malloc calls made before it do not depend on it
+__attribute__((constructor)) void RegisterForkHandlers()
+{
+    pthread_atfork(PrepareFork,AfterFork,AfterFork);
+}
+
+
+void* SlabAllocate(int size_class)
+{
+    ThreadCache* tcache=ThreadCache::Get();
+    void* ptr;
+    if(tcache!=NULL)
+        ptr=tcache->Allocate(size_class);
+    else
+    {
+        sSlabAllocator->Lock();
+        ptr=sSlabAllocator->Allocate(size_class);
+        sSlabAllocator->Unlock();
+    }
+    return ptr;
+}
+
+void* smalloc(size_t size)
+{
+    PROFILE_CALL(PROFILE_MALLOC,size);
+    HEAP_SAMPLE_SCOPE();
+    if(size==0 || size>MAX_MALLOC_SIZE)
+        return NULL;
+    size=AlignSizeToEight(size);
+    if(size<=SLAB_MAX_SIZE)
+    {
+        void* ptr=SlabAllocate(sSlabAllocator->IndexOfClass(size));
+        if(ptr!=NULL)
+            return HEAP_SAMPLE_ALLOC(ptr,size);
+    }
+    BlockManager* arena=sBlockManager;
+    arena->Lock();
+    void* ptr=arena->BlockAllocate(size);
+    arena->Unlock();
+    return HEAP_SAMPLE_ALLOC(ptr,size);
+}
+
+/**
+ * Allocates size bytes aligned to alignment, which has to be a power of two. Small requests take a slab class
+ * whose slots are aligned, the rest are carved out of the heap or get an aligned mapping. sfree and srealloc
+ * accept the result like any other block.
+ */
+void* smemalign(size_t alignment,size_t size)
+{
+    PROFILE_CALL(PROFILE_MEMALIGN,size);
+    HEAP_SAMPLE_SCOPE();
+    if(size==0 || size>MAX_MALLOC_SIZE || alignment==0 || (alignment & (alignment-1))!=0)
+        return NULL;
+    if(alignment<=MALLOC_ALIGNMENT)
+        return HEAP_SAMPLE_ALLOC(smalloc(size),size);
+    size=AlignSizeToEight(size);
+    if(size<=SLAB_MAX_SIZE)
+    {
+        int size_class=sSlabAllocator->IndexOfAlignedClass(size,alignment);
+        void* ptr= (size_class<0)? NULL : SlabAllocate(size_class);
+        if(ptr!=NULL)
+            return HEAP_SAMPLE_ALLOC(ptr,size);
+    }
+    BlockManager* arena=sBlockManager;
+    arena->Lock();
+    void* ptr=arena->BlockAllocateAligned(alignment,size);
+    arena->Unlock();
+    return HEAP_SAMPLE_ALLOC(ptr,size);
+}
+
+void* saligned_alloc(size_t alignment,size_t size)
+{
+    return smemalign(alignment,size);
+}
+
+int sposix_memalign(void** memptr,size_t alignment,size_t size)
+{
+    if(alignment<sizeof(void*) || (alignment & (alignment-1))!=0)
+        return EINVAL;
+    if(size==0)
+    {
+        *memptr=NULL;
+        return 0;
+    }
+    void* ptr=smemalign(alignment,size);
+    if(ptr==NULL)
+        return ENOMEM;
+    *memptr=ptr;
+    return 0;
+}
+
+/**
+ * Zeroes only what may hold old data: slab slots, blocks reused from the histogram and cached mappings.
+ * Fresh mappings and the never written or released end of the newest segment are zero already, and writing
+ * them would commit every page up front. A num*size overflowing MAX_MALLOC_SIZE is rejected.
+ */
+void* scalloc(size_t num,size_t size)
+{
+    if(size!=0 && num>MAX_MALLOC_SIZE/size)
+        return NULL;
+    size_t bytes=num*size;
+    if(bytes==0)
+        return NULL;
+    PROFILE_CALL(PROFILE_CALLOC,bytes);
+    HEAP_SAMPLE_SCOPE();
+    if(AlignSizeToEight(bytes)<=SLAB_MAX_SIZE)
+    {
+        void* ptr=smalloc(bytes);
+        if(ptr==NULL)
+            return NULL;
+        return HEAP_SAMPLE_ALLOC(memset(ptr,0,bytes),bytes);
+    }
+    size_t dirty;
+    BlockManager* arena=sBlockManager;
+    arena->Lock();
+    void* ptr=arena->BlockAllocate(AlignSizeToEight(bytes),&dirty);
+    arena->Unlock();
+    if(ptr==NULL)
+        return NULL;
+    memset(ptr,0,(dirty<bytes)? dirty : bytes);
+    return HEAP_SAMPLE_ALLOC(ptr,bytes);
+}
+
+void sfree(void* p)
+{
+    if(p==NULL)
+        return;
+    PROFILE_CALL(PROFILE_FREE,0);
+    HEAP_SAMPLE_SCOPE();
+    HEAP_SAMPLE_FREE(p);
+    if(sSlabAllocator->Contains(p))
+    {
+        ThreadCache* tcache=ThreadCache::Get();
+        if(tcache!=NULL)
+            tcache->Free(p);
+        else
+        {
+            sSlabAllocator->Lock();
+            sSlabAllocator->Free(p);
+            sSlabAllocator->Unlock();
+        }
+        return;
+    }
+    MallocMetadata* md=MetaDataOf(p);
+    if(IsMmapped(md))
+    {
+        BlockManager::FreeMmapBlock(md);
+        return;
+    }
+    BlockManager* arena=BlockManager::OwnerOf(md);
+    if(arena!=sBlockManager)
+    {
+        PROFILE_COUNT(PROFILE_REMOTE_FREE);
+        arena->PushRemoteFree(md);
+        return;
+    }
+    arena->Lock();
+    arena->FreeBlock(p);
+    arena->Unlock();
+}
+
+/**
+ * Allocates n blocks of size bytes into out, for callers creating many objects of one size at once.
+ * Slab sizes take all their slots under a single lock, larger blocks are carved out of one heap block.
+ * Returns how many blocks were allocated, fewer than n only when memory runs out.
+ */
+size_t smalloc_batch(size_t size,size_t n,void** out)
+{
+    HEAP_SAMPLE_SCOPE();
+    if(size==0 || size>MAX_MALLOC_SIZE)
+        return 0;
+    size=AlignSizeToEight(size);
+    size_t done=0;
+    if(size<=SLAB_MAX_SIZE)
+    {
+        int size_class=sSlabAllocator->IndexOfClass(size);
+        sSlabAllocator->Lock();
+        while(done<n && (out[done]=sSlabAllocator->Allocate(size_class))!=NULL)
+            done++;
+        sSlabAllocator->Unlock();
+    }
+    if(done<n)
+    {
+        BlockManager* arena=sBlockManager;
+        arena->Lock();
+        done+=arena->BlockAllocateBatch(size,n-done,out+done);
+        arena->Unlock();
+    }
+    for(size_t i=0;i<done;i++)
+        (void)HEAP_SAMPLE_ALLOC(out[i],size);
+    return done;
+}
+
+/**
+ * Frees the n blocks of ptrs, which is reordered on the way. Slab slots go back under a single lock, the other
+ * blocks are sorted by address and those of the calling thread's arena are freed under a single lock,
+ * with adjacent ones united first.
+ */
+void sfree_batch(void** ptrs,size_t n)
+{
+    HEAP_SAMPLE_SCOPE();
+    for(size_t i=0;i<n;i++)
+        HEAP_SAMPLE_FREE(ptrs[i]);
+    //slab slots need no order, only the blocks after them are sorted
+    size_t slots=std::partition(ptrs,ptrs+n,[](void* p){ return sSlabAllocator->Contains(p); })-ptrs;
+    ThreadCache* tcache=ThreadCache::Get();
+    if(tcache!=NULL)
+        tcache->FreeToSlabs(ptrs,slots);
+    else
+        for(size_t i=0;i<slots;i++)
+            sfree(ptrs[i]);
+    std::sort(ptrs+slots,ptrs+n);
+    n=std::unique(ptrs+slots,ptrs+n)-ptrs;
+    BlockManager* arena=sBlockManager;
+    size_t i=slots;
+    while(i<n)
+    {
+        size_t j=i;
+        if(ptrs[i]==NULL)
+        {
+            i++;
+            continue;
+        }
+        MallocMetadata* md=MetaDataOf(ptrs[i]);
+        if(IsMmapped(md) || BlockManager::OwnerOf(md)!=arena)
+        {
+            sfree(ptrs[i++]);
+            continue;
         }
+        while(j<n && !IsMmapped(MetaDataOf(ptrs[j])) && BlockManager::OwnerOf(MetaDataOf(ptrs[j]))==arena)
+            j++;
+        arena->Lock();
+        arena->FreeSortedBlocks(ptrs+i,j-i);
+        arena->Unlock();
+        i=j;
+    }
+}
+
+/**
+ * sfree for callers which know the size p was allocated (or last reallocated) with, like C++ sized delete.
+ * A slab slot goes to the thread cache under the size class of size, without reading the header of its span.
+ * Every slot is in the class of the size it was asked with, smemalign included.
+ * Heap and mmap blocks need their header to be coalesced anyway and take the sfree path.
+ * Builds without NDEBUG check size against the block.
+ */
+void sfree_sized(void* p,size_t size)
+{
+    if(p==NULL)
+        return;
+    size=AlignSizeToEight(size);
+    PROFILE_CALL(PROFILE_FREE,0);
+    HEAP_SAMPLE_SCOPE();
+    HEAP_SAMPLE_FREE(p);
+    if(size==0 || size>SLAB_MAX_SIZE || !sSlabAllocator->Contains(p))
+    {
+        assert(sSlabAllocator->Contains(p) || PayloadSize(MetaDataOf(p))>=size);
+        sfree(p);
+        return;
+    }
+    int size_class=sSlabAllocator->IndexOfClass(size);
+    assert(sSlabAllocator->SpanOf(p)->size_class==size_class);
+    ThreadCache* tcache=ThreadCache::Get();
+    if(tcache!=NULL)
+        tcache->Free(p,size_class);
+    else
+    {
+        sSlabAllocator->Lock();
+        sSlabAllocator->Free(p);
+        sSlabAllocator->Unlock();
+    }
+}
+
+//bytes the caller may use at p, at least what it asked for
+size_t smalloc_usable_size(void* p)
+{
+    if(p==NULL)
+        return 0;
+    if(sSlabAllocator->Contains(p))
+        return SlabAllocator::ClassSize(sSlabAllocator->SpanOf(p)->size_class);
+    return PayloadSize(MetaDataOf(p));
+}
+
+void* srealloc(void* oldp, size_t size)
+{
+    PROFILE_CALL(PROFILE_REALLOC,size);
+    HEAP_SAMPLE_SCOPE();
+    if(size==0 || size>MAX_MALLOC_SIZE)
+        return NULL;
+    if(oldp==NULL)
+        return HEAP_SAMPLE_ALLOC(smalloc(size),size);
+    //the result counts as a new allocation, so the sample of oldp goes first, even when oldp survives a failure
+    HEAP_SAMPLE_FREE(oldp);
+    size=AlignSizeToEight(size);
+    if(sSlabAllocator->Contains(oldp))
+    {
+        int size_class=sSlabAllocator->SpanOf(oldp)->size_class;
+        size_t old_size=SlabAllocator::ClassSize(size_class);
+        if(size<=SLAB_MAX_SIZE && sSlabAllocator->IndexOfClass(size)==size_class)
+            return HEAP_SAMPLE_ALLOC(oldp,size);
+        void* ptr=smalloc(size);
+        if(ptr==NULL)
+            return NULL;
+        memmove(ptr,oldp,(size<old_size)? size : old_size);
+        sfree(oldp);
+        return HEAP_SAMPLE_ALLOC(ptr,size);
+    }
+    MallocMetadata* md=MetaDataOf(oldp);
+    BlockManager* arena= IsMmapped(md)? sBlockManager : BlockManager::OwnerOf(md);
+    arena->Lock();
+    void* ptr=arena->Rellocate(oldp,size);
+    arena->Unlock();
+    return HEAP_SAMPLE_ALLOC(ptr,size);
+}
+
+size_t _num_free_blocks()
+{
+    size_t counter=BlockManager::SumOverArenas(&BlockManager::numFreeBlocks);
+    counter+=sSlabAllocator->numFreeBlocks()+ThreadCache::numCachedBlocks();
+    return counter;
+}
+
+size_t _num_free_bytes()
+{
+    size_t counter=BlockManager::SumOverArenas(&BlockManager::numFreeBytes);
+    counter+=sSlabAllocator->numFreeBytes()+ThreadCache::numCachedBytes();
+    return counter;
+}
 
-        bool IsNextFree(MallocMetadata* ptr)
-        {
-            return (ptr->list_next!=NULL && IsBlockFree(ptr->list_next));
-        }
-        
-        MallocMetadata* Wilderness()
-        {
-            if(tail!=NULL && tail->is_free)
-                return tail;
-            return NULL;
-        }
+size_t _num_allocated_blocks()
+{
+    size_t counter=BlockManager::SumOverArenas(&BlockManager::numAllocatedBlocks)+BlockManager::numMmapBlocks();
+    counter+=sSlabAllocator->numAllocatedBlocks();
+    return counter;
+}
 
-        bool isLast(MallocMetadata* ptr)
-        {
-            return (head!=NULL && ptr==tail);
-        }
-        
-        int numFreeBlocksList()
-        {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                if(ptr->is_free)
-                    counter++;
-                ptr=ptr->histo_next;
-            }
-            return counter;
-        }
-        
-        size_t numFreeBytesList()
-        {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                if(ptr->is_free)
-                    counter+=ptr->size-AlignSizeToEight(sizeof(MallocMetadata));
-                ptr=ptr->histo_next;
-            }
-            return counter;
-        }
+size_t _num_allocated_bytes()
+{
+    size_t counter=BlockManager::SumOverArenas(&BlockManager::numAllocatedBytes)+BlockManager::numMmapBytes();
+    counter+=sSlabAllocator->numAllocatedBytes();
+    return counter;
+}
 
+size_t _num_meta_data_bytes()
+{
+    size_t counter=BlockManager::SumOverArenas(&BlockManager::numMetaDataBytes)+BlockManager::numMmapBlocks()*META_DATA_SIZE;
+    counter+=sSlabAllocator->numMetaDataBytes();
+    return counter;
+}
 
-        size_t numAllocatedBlocksList()
-        {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                counter++;
-                ptr=ptr->list_next;
-            }
-            return counter;
-        }
+size_t _num_released_bytes()
+{
+    size_t counter=BlockManager::SumOverArenas(&BlockManager::numReleasedBytes)+sMmapCache->numReleasedBytes();
+    counter+=sSlabAllocator->numReleasedBytes();
+    return counter;
+}
 
-        size_t numAllocatedBytesList()
-        {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                counter+=ptr->size-AlignSizeToEight(sizeof(MallocMetadata));
-                ptr=ptr->list_next;
-            }
-            return counter;
-        }
+size_t _mmap_threshold()
+{
+    return BlockManager::MmapThreshold();
+}
 
-        size_t numMetaDataBytesList()
-        {
-            size_t counter=0;
-            MallocMetadata* ptr=head;
-            while(ptr!=NULL)
-            {
-                counter+=AlignSizeToEight(sizeof(MallocMetadata));
-                ptr=ptr->list_next;
-            }
-            return counter;
-        }
-};
+size_t _num_mmap_threshold_updates()
+{
+    return BlockManager::numMmapThresholdUpdates();
+}
 
+//bytes mapped with MAP_HUGETLB or advised MADV_HUGEPAGE, how much THP really backs shows as AnonHugePages in smaps
+size_t _num_huge_advised_bytes()
+{
+    return BlockManager::numHugeAdvisedBytes();
+}
 
-class BlockManager
+//payload size of the largest free heap block of any arena, what a request can get without growing a heap
+size_t _largest_free_block()
 {
-    private:
-    SbrkBlockList histogram[NUM_OF_BINS];
-    SbrkBlockList all_blocks_list;
-    size_t mmap_allocated_blocks;
-    size_t mmap_allocated_bytes;
+    return BlockManager::MaxOverArenas(&BlockManager::LargestFreeBlock);
+}
 
-    BlockManager() :all_blocks_list(), mmap_allocated_blocks(0), mmap_allocated_bytes(0)
-    {
-        for(int i=0;i<NUM_OF_BINS;i++)
-            histogram[i]=SbrkBlockList();
-    }
-    public:
+size_t _size_meta_data()
+{
+    return sBlockManager->numMetaData();    
+}
 
-    
-    static BlockManager* instance()
-		{
-			static BlockManager instance;
-			return &instance;
-		}
+/**
+ * Returns free memory to the OS: trims the wilderness of every arena, releases the inner pages of its free
+ * blocks, the pages of the empty slab spans and the cached mmap blocks.
+ * Returns 1 if any memory was released, like malloc_trim.
+ */
+int _trim()
+{
+    size_t counter=BlockManager::TrimArenas()+sMmapCache->Flush();
+    sSlabAllocator->Lock();
+    counter+=sSlabAllocator->Trim();
+    sSlabAllocator->Unlock();
+    return counter>0;
+}
 
-    int IndexOfHisto(size_t size)//size without metaData
-    {
-        if (size == MMAP_ALLOCATION_MIN_SIZE)
-           return NUM_OF_BINS-1;
-        else
-            return size/BIN_SIZE;
-    }
-    void Split(MallocMetadata* ptr,size_t size)
+#define NUM_GENERAL_STATS 11
+const char* const general_stat_names[NUM_GENERAL_STATS]={"free_blocks","free_bytes","allocated_blocks",
+    "allocated_bytes","meta_data_bytes","released_bytes","huge_advised_bytes","mmap_threshold","mmap_threshold_updates",
+    "size_meta_data","largest_free_block"};
+
+size_t GeneralStat(int i)
+{
+    switch(i)
     {
-        MallocMetadata* md_new_free = (MallocMetadata*)((long)(ptr)+(long)(size));
-        md_new_free->addr=(void*)((long)(md_new_free)+(long)(AlignSizeToEight(sizeof(MallocMetadata))));
-        md_new_free->size=ptr->size-size;
-        ptr->size=size;
-        if(ptr->list_next==NULL)
-            all_blocks_list.insertAtListEnd(md_new_free);
-        else
-            all_blocks_list.insertAfterBlockList(md_new_free,ptr);
-        md_new_free->is_free=true;
-        histogram[IndexOfHisto(md_new_free->size-AlignSizeToEight(sizeof(MallocMetadata)))].insertBySizeHisto(md_new_free);    
+        case 0: return _num_free_blocks();
+        case 1: return _num_free_bytes();
+        case 2: return _num_allocated_blocks();
+        case 3: return _num_allocated_bytes();
+        case 4: return _num_meta_data_bytes();
+        case 5: return _num_released_bytes();
+        case 6: return _num_huge_advised_bytes();
+        case 7: return _mmap_threshold();
+        case 8: return _num_mmap_threshold_updates();
+        case 9: return _size_meta_data();
+        default: return _largest_free_block();
     }
+}
 
-    void* BlockAllocate(size_t size)
+/**
+ * Writes every statistic to out as "name value" lines: the counters above, and with SMALLOC_PROFILE the events,
+ * the histograms of the sizes and the sampled latencies, and the hits and misses of the bins, skipping zeros.
+ * The values are read before anything is written, since writing to out may allocate.
+ */
+void _dump_stats(FILE* out)
+{
+    size_t general[NUM_GENERAL_STATS];
+    for(int i=0;i<NUM_GENERAL_STATS;i++)
+        general[i]=GeneralStat(i);
+    for(int i=0;i<NUM_GENERAL_STATS;i++)
+        fprintf(out,"%s %zu\n",general_stat_names[i],general[i]);
+#ifdef SMALLOC_PROFILE
+    char name[64];
+    for(size_t i=0;i<Profiler::NumEntries();i++)
     {
-        if(size > MMAP_ALLOCATION_MIN_SIZE)//should use mmap and not sbrk
-        {
-            MallocMetadata* meta_data_ptr=(MallocMetadata*)(mmap(NULL, size+AlignSizeToEight(sizeof(MallocMetadata)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
-            if(meta_data_ptr==(MallocMetadata*)(-1))
-                    return NULL;
-            else{
-                    meta_data_ptr->addr=(void*)((long)meta_data_ptr+(long)AlignSizeToEight(sizeof(MallocMetadata)));
-                    meta_data_ptr->is_free=false;
-                    meta_data_ptr->size=size+AlignSizeToEight(sizeof(MallocMetadata));
-                    meta_data_ptr->list_next = NULL;
-                    meta_data_ptr->list_prev = NULL;
-                    meta_data_ptr->histo_next = NULL;
-                    meta_data_ptr->histo_prev = NULL;
-                    mmap_allocated_blocks++;
-                    mmap_allocated_bytes += size;
-                    return meta_data_ptr->addr;
-            }
-        }
-        size_t real_size=size+AlignSizeToEight(sizeof(MallocMetadata));
-        int i= ((size==MMAP_ALLOCATION_MIN_SIZE)? NUM_OF_BINS-1 : size/BIN_SIZE);
-        bool found=false;
-        MallocMetadata* ptr_to_allocate_at;
-        while(i<NUM_OF_BINS && !found)
-        {
-            ptr_to_allocate_at=histogram[i].findBySizeHist(size);
-            if(ptr_to_allocate_at!=NULL)
-                found=true;
-            i++;
-        }
-        i--;
-        if(!found)
-        {
-            MallocMetadata* free_tail = all_blocks_list.Wilderness();
-            if(free_tail)
-            /**
-            compute how much to sbrk. - done
-            sbrk right part. - done
-            hist[i]removefromHisto(befor_tail) - done
-            before_tail_size =real_size - done
-            is_free=false
-            **/
-            {
-                if(sbrk(real_size - free_tail->size)==(void*)-1)
-                    return NULL;
-                histogram[IndexOfHisto(free_tail->size-AlignSizeToEight(sizeof(MallocMetadata)))].removeHisto(free_tail);
-                free_tail->size=real_size;
-                free_tail->is_free=false;
-                return free_tail->addr;
-            }
-            else
-            {
-                MallocMetadata* meta_data_ptr=(MallocMetadata*)(sbrk(AlignSizeToEight(sizeof(MallocMetadata))));
-                void* new_address=(void*)(sbrk(size));
-                if(meta_data_ptr==(MallocMetadata*)(-1) || new_address==(void*)(-1))
-                    return NULL;
-                meta_data_ptr->histo_next=NULL;
-                meta_data_ptr->histo_prev=NULL;
-                meta_data_ptr->size=real_size;
-                meta_data_ptr->is_free=false;
-                meta_data_ptr->addr=new_address;
-                all_blocks_list.insertAtListEnd(meta_data_ptr);
-                return new_address;
-            }
-        }
-        else
-        {
-            //remove from histo list and update block isnt free
-            histogram[i].removeHisto(ptr_to_allocate_at);
-            ptr_to_allocate_at->is_free = false;
-            if((long)(ptr_to_allocate_at->size-real_size)>=MIN_SPLIT_SIZE)//splitting
-                Split(ptr_to_allocate_at, real_size);
-            return ptr_to_allocate_at->addr;
-        }
+        size_t value=Profiler::Value(i);
+        if(value==0 && i>=PROFILE_NUM_EVENTS)
+            continue;
+        Profiler::Name(i,name,sizeof(name));
+        fprintf(out,"%s %zu\n",name,value);
     }
+#endif
+    fflush(out);
+}
 
-    void FreeBlock(void* addrs)
-        /**
-        compute metaData = addrs-sizeof(metaData) in all_bblock_manager. - done
-        check if addrs is released(is_free), if so then return - done
-        enter freed block to histogram
-        check before block if free- if so, (merge and update ptr to before one). - done
-        merge: 
-                check after block if free - if so,merge.
-        is_free=true
-        **/
-    {
-        MallocMetadata* md_to_free=(MallocMetadata*)((long)addrs-AlignSizeToEight(sizeof(MallocMetadata)));
-        if(md_to_free->size-AlignSizeToEight(sizeof(MallocMetadata))>MMAP_ALLOCATION_MIN_SIZE) //this block is of mmap, should use unmap
-        {
-            mmap_allocated_blocks--;
-            size_t data_size=(size_t)((size_t)md_to_free->size - (size_t)AlignSizeToEight(sizeof(MallocMetadata)));
-            mmap_allocated_bytes -= data_size;
-            munmap(md_to_free, md_to_free->size);
-            return;
-        }
-        else{ //should regular free
-            if (all_blocks_list.IsBlockFree(md_to_free))
-                return;
-            md_to_free->is_free=true;
-            histogram[IndexOfHisto(md_to_free->size-AlignSizeToEight(sizeof(MallocMetadata)))].insertBySizeHisto(md_to_free);
-            if(all_blocks_list.IsPrevFree(md_to_free))
-                md_to_free=Merge(md_to_free->list_prev,true,false);
-            if(all_blocks_list.IsNextFree(md_to_free))
-                md_to_free=Merge(md_to_free,true,false);
-        }
+//the value of one statistic named as in _dump_stats, -1 when there is no such statistic in this build
+long _query_stat(const char* name)
+{
+    for(int i=0;i<NUM_GENERAL_STATS;i++)
+        if(strcmp(name,general_stat_names[i])==0)
+            return (long)GeneralStat(i);
+#ifdef SMALLOC_PROFILE
+    char entry[64];
+    for(size_t i=0;i<Profiler::NumEntries();i++)
+    {
+        Profiler::Name(i,entry,sizeof(entry));
+        if(strcmp(name,entry)==0)
+            return (long)Profiler::Value(i);
     }
+#endif
+    return -1;
+}
 
-    
-    MallocMetadata* Merge(MallocMetadata* first_block,bool free, bool mirror)    
+/**
+ * Writes a snapshot of the memory layout to out, one JSON object per line, for plotting heap maps offline:
+ * "segment" and "block" lines for every heap segment and its blocks (address, payload size, state and bin),
+ * "span" lines for the slab spans and "mmap_cached" lines for the cached mappings. Live mmap blocks are not
+ * kept in any list, so only their totals appear, in the last line, a "summary" with the largest free block,
+ * the external fragmentation (1 - largest free / free bytes) and the free blocks by power of two of their size.
+ * Every arena is locked in turn, so the snapshot is consistent per arena and not across arenas.
+ */
+void _dump_heap(FILE* out)
+{
+    fflush(out);
+    HeapSnapshot snapshot;
+    memset(&snapshot,0,sizeof(snapshot));
+    SnapshotWriter writer(fileno(out));
+    BlockManager::DumpArenas(&writer,&snapshot);
+    sSlabAllocator->Lock();
+    sSlabAllocator->Dump(&writer);
+    sSlabAllocator->Unlock();
+    size_t cached_bytes=sMmapCache->Dump(&writer);
+    double fragmentation= (snapshot.free_bytes==0)? 0 : 1-(double)snapshot.largest_free/snapshot.free_bytes;
+    writer.Printf("{\"type\":\"summary\",\"segments\":%zu,\"used_blocks\":%zu,\"used_bytes\":%zu,\"free_blocks\":%zu,"
+                  "\"free_bytes\":%zu,\"released_blocks\":%zu,\"largest_free\":%zu,\"fragmentation\":%.4f,"
+                  "\"mmap_blocks\":%zu,\"mmap_bytes\":%zu,\"mmap_cached_bytes\":%zu,\"free_sizes\":{",
+                  snapshot.segments,snapshot.used_blocks,snapshot.used_bytes,snapshot.free_blocks,snapshot.free_bytes,
+                  snapshot.released_blocks,snapshot.largest_free,fragmentation,BlockManager::numMmapBlocks(),
+                  BlockManager::numMmapBytes(),cached_bytes);
+    const char* separator="";
+    for(int i=0;i<SNAPSHOT_BUCKETS;i++)
     {
-        MallocMetadata* second_block=all_blocks_list.removeList(first_block->list_next);
-        MallocMetadata* md_to_free= mirror? second_block: first_block;
-        histogram[IndexOfHisto(md_to_free->size-AlignSizeToEight(sizeof(MallocMetadata)))].removeHisto(md_to_free);
-        first_block->size+=second_block->size;
-        if(free)
-        {
-            histogram[IndexOfHisto(second_block->size-AlignSizeToEight(sizeof(MallocMetadata)))].removeHisto(second_block);
-            histogram[IndexOfHisto(first_block->size-AlignSizeToEight(sizeof(MallocMetadata)))].insertBySizeHisto(first_block);
-        }
-        else
-            first_block->is_free=false;
-        return first_block;
+        if(snapshot.free_sizes[i]==0)
+            continue;
+        writer.Printf("%s\"%lu\":%zu",separator,1UL<<i,snapshot.free_sizes[i]);
+        separator=",";
     }
+    writer.Printf("}}\n");
+}
 
+#ifdef SMALLOC_HEAP_PROFILE
+/**
+ * Writes the live sampled allocations to out in the pprof heap format:
+ * pprof --text <program> <file> shows which call stacks hold the memory.
+ */
+void _dump_heap_profile(FILE* out)
+{
+    fflush(out);
+    SnapshotWriter writer(fileno(out));
+    HeapSampler::Dump(&writer);
+}
 
+//mean bytes allocated between two samples, 0 stops the sampling. Each thread switches after its next sample
+void _set_heap_sample_rate(size_t rate)
+{
+    HeapSampler::SetRate(rate);
+}
+#endif
 
-    void* Rellocate(void* oldp,size_t size)
-    {
-        MallocMetadata* md_to_realloc=(MallocMetadata*)((long)oldp-AlignSizeToEight(sizeof(MallocMetadata)));
-        if(md_to_realloc->size-AlignSizeToEight(sizeof(MallocMetadata)) > MMAP_ALLOCATION_MIN_SIZE) //should use mmap
-        {
-            if(size == (md_to_realloc->size -AlignSizeToEight(sizeof(MallocMetadata))))
-                return oldp;
-            MallocMetadata* meta_data_ptr=(MallocMetadata*)(mmap(0, size+AlignSizeToEight(sizeof(MallocMetadata)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
-            if(meta_data_ptr==(MallocMetadata*)(-1))
-                    return NULL;
-            mmap_allocated_bytes -= (md_to_realloc->size-AlignSizeToEight(sizeof(MallocMetadata)));
-            mmap_allocated_bytes += size;
-            meta_data_ptr->addr=(void*)((long)meta_data_ptr+(long)(AlignSizeToEight(sizeof(MallocMetadata))));
-            size_t amount_to_cpy= (size<(md_to_realloc->size-AlignSizeToEight(sizeof(MallocMetadata))) ? size : (md_to_realloc->size-AlignSizeToEight(sizeof(MallocMetadata))));
-            memmove(meta_data_ptr->addr,oldp,amount_to_cpy);
-            munmap(md_to_realloc,md_to_realloc->size);
-            meta_data_ptr->size=size+AlignSizeToEight(sizeof(MallocMetadata));
-            return meta_data_ptr->addr;
-        }
-        size_t real_size=size+AlignSizeToEight(sizeof(MallocMetadata));
-        size_t old_size = md_to_realloc->size-AlignSizeToEight(sizeof(MallocMetadata));
-        if(md_to_realloc->size-AlignSizeToEight(sizeof(MallocMetadata)) >= size)
-        {
-            if(md_to_realloc->size-real_size >= MIN_SPLIT_SIZE+AlignSizeToEight(sizeof(MallocMetadata)))
-                Split(md_to_realloc, real_size);
-            return oldp;
-        }
-        else if(all_blocks_list.IsPrevFree(md_to_realloc) && md_to_realloc->size+md_to_realloc->list_prev->size-AlignSizeToEight(sizeof(MallocMetadata)) > size)
-        {
-            md_to_realloc=Merge(md_to_realloc->list_prev,false,false);
-            if((long)(md_to_realloc->size-real_size-AlignSizeToEight(sizeof(MallocMetadata)))>=MIN_SPLIT_SIZE)
-                Split(md_to_realloc, real_size);
-            memmove(md_to_realloc->addr,oldp,old_size);
-            return md_to_realloc->addr;
-        }
-        else if(all_blocks_list.IsNextFree(md_to_realloc) && md_to_realloc->size+md_to_realloc->list_next->size-AlignSizeToEight(sizeof(MallocMetadata)) > size)
-        {
-            md_to_realloc=Merge(md_to_realloc,false,true);
-            if((long)(md_to_realloc->size-real_size-AlignSizeToEight(sizeof(MallocMetadata)))>=MIN_SPLIT_SIZE)
-                Split(md_to_realloc, real_size);
-            memmove(md_to_realloc->addr,oldp,old_size);
-            return md_to_realloc->addr;
-        }
-        else if(all_blocks_list.IsPrevFree(md_to_realloc) && all_blocks_list.IsNextFree(md_to_realloc) 
-                && md_to_realloc->size+md_to_realloc->list_next->size+md_to_realloc->list_prev->size-AlignSizeToEight(sizeof(MallocMetadata)) > size)
-        {
-            md_to_realloc=Merge(md_to_realloc->list_prev,false,false);
-            md_to_realloc=Merge(md_to_realloc,false,true);
-            if((long)(md_to_realloc->size-real_size-AlignSizeToEight(sizeof(MallocMetadata)))>=MIN_SPLIT_SIZE)
-                Split(md_to_realloc, real_size);
-            memmove(md_to_realloc->addr,oldp,old_size);
-            return md_to_realloc->addr;
-        }
+#ifdef SMALLOC_PRELOAD
+/**
+ * Built with -DSMALLOC_PRELOAD (make libsmalloc.so) the allocator replaces the libc one, either linked in or
+ * loaded with LD_PRELOAD. The wrappers only add the standard corner cases: malloc(0) returns a unique pointer,
+ * realloc(p,0) frees p and failures set errno.
+ */
+extern "C" {
 
-        if (all_blocks_list.isLast(md_to_realloc))//Wildrness on itself
-        {
-            if(sbrk(real_size - md_to_realloc->size)==(void*)-1)
-                return NULL;
-            md_to_realloc->size=real_size;
-            return oldp;
-        }
-        void* ptr = BlockAllocate(size);
-        if (!ptr)
-            return NULL;
-        else
-        {
-            memmove(ptr,oldp,old_size);
-            FreeBlock(oldp);
-            return ptr;
-        }
-    }
+void* malloc(size_t size) noexcept
+{
+    void* ptr=smalloc((size==0)? 1 : size);
+    if(ptr==NULL)
+        errno=ENOMEM;
+    return ptr;
+}
 
+void free(void* p) noexcept
+{
+    sfree(p);
+}
 
-    size_t numFreeBlocks()
-    {
-        size_t counter=0;
-        for(int i=0;i<NUM_OF_BINS;i++)
-            counter+=histogram[i].numFreeBlocksList();
-        return counter;
-    }
+void* calloc(size_t num,size_t size) noexcept
+{
+    void* ptr= (num==0 || size==0)? scalloc(1,1) : scalloc(num,size);
+    if(ptr==NULL)
+        errno=ENOMEM;
+    return ptr;
+}
 
-    size_t numFreeBytes()
+void* realloc(void* p,size_t size) noexcept
+{
+    if(p!=NULL && size==0)
     {
-        size_t counter=0;
-        for(int i=0;i<NUM_OF_BINS;i++)
-            counter+=histogram[i].numFreeBytesList();
-        return counter;
+        sfree(p);
+        return NULL;
     }
+    void* ptr=srealloc(p,(size==0)? 1 : size);
+    if(ptr==NULL)
+        errno=ENOMEM;
+    return ptr;
+}
 
-    size_t numAllocatedBlocks()
+void* reallocarray(void* p,size_t num,size_t size) noexcept
+{
+    if(size!=0 && num>(size_t)(-1)/size)
     {
-        return all_blocks_list.numAllocatedBlocksList()+mmap_allocated_blocks;
+        errno=ENOMEM;
+        return NULL;
     }
+    return realloc(p,num*size);
+}
 
-    size_t numAllocatedBytes()
+void* memalign(size_t alignment,size_t size) noexcept
+{
+    if(alignment==0 || (alignment & (alignment-1))!=0)
     {
-        return all_blocks_list.numAllocatedBytesList()+mmap_allocated_bytes;
+        errno=EINVAL;
+        return NULL;
     }
+    void* ptr=smemalign(alignment,(size==0)? 1 : size);
+    if(ptr==NULL)
+        errno=ENOMEM;
+    return ptr;
+}
 
-    size_t numMetaDataBytes()
+void* aligned_alloc(size_t alignment,size_t size) noexcept
+{
+    return memalign(alignment,size);
+}
+
+int posix_memalign(void** memptr,size_t alignment,size_t size) noexcept
+{
+    return sposix_memalign(memptr,alignment,(size==0)? 1 : size);
+}
+
+void* valloc(size_t size) noexcept
+{
+    return memalign(PageSize(),size);
+}
+
+void* pvalloc(size_t size) noexcept
+{
+    return memalign(PageSize(),AlignSizeToPage((size==0)? 1 : size));
+}
+
+size_t malloc_usable_size(void* p) noexcept
+{
+    return smalloc_usable_size(p);
+}
+
+}
+
+//operator new retries through the new handler and throws once there is none, like the libstdc++ one
+void* NewOrThrow(size_t size,size_t alignment)
+{
+    while(true)
     {
-        return all_blocks_list.numMetaDataBytesList()+mmap_allocated_blocks*AlignSizeToEight(sizeof(MallocMetadata));
+        void* ptr= (alignment<=MALLOC_ALIGNMENT)? malloc(size) : memalign(alignment,size);
+        if(ptr!=NULL)
+            return ptr;
+        std::new_handler handler=std::get_new_handler();
+        if(handler==NULL)
+            throw std::bad_alloc();
+        handler();
     }
+}
 
-    size_t numMetaData()
-    {
-        return AlignSizeToEight(sizeof(MallocMetadata));
+void* NewOrNull(size_t size,size_t alignment) noexcept
+{
+    try{
+        return NewOrThrow(size,alignment);
+    }catch(...){
+        return NULL;
     }
-        
-};
+}
 
+void* operator new(size_t size)
+{
+    return NewOrThrow(size,MALLOC_ALIGNMENT);
+}
 
-void* smalloc(size_t size)
+void* operator new[](size_t size)
 {
-    if(size==0 || size>MAX_MALLOC_SIZE)
-        return NULL;
-    size=AlignSizeToEight(size);
-    return sBlockManager->BlockAllocate(size);
+    return NewOrThrow(size,MALLOC_ALIGNMENT);
 }
 
-void* scalloc(size_t num,size_t size)
+void* operator new(size_t size,const std::nothrow_t&) noexcept
 {
-    void* ptr=smalloc(num*size);
-    if(ptr==NULL)
-        return NULL;
-    return memset(ptr,0,num*size);
+    return NewOrNull(size,MALLOC_ALIGNMENT);
 }
 
-void sfree(void* p)
+void* operator new[](size_t size,const std::nothrow_t&) noexcept
 {
-    if(p==NULL)
-        return;
-    sBlockManager->FreeBlock(p);
+    return NewOrNull(size,MALLOC_ALIGNMENT);
 }
 
-void* srealloc(void* oldp, size_t size)
+void operator delete(void* p) noexcept
 {
-    if(size==0 || size>MAX_MALLOC_SIZE)
-        return NULL;
-    if(oldp==NULL)
-        return smalloc(size);
-    size=AlignSizeToEight(size);
-    return sBlockManager->Rellocate(oldp,size);
+    sfree(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    sfree(p);
 }
 
+void operator delete(void* p,const std::nothrow_t&) noexcept
+{
+    sfree(p);
+}
 
-size_t _num_free_blocks()
+void operator delete[](void* p,const std::nothrow_t&) noexcept
 {
-    return sBlockManager->numFreeBlocks();
+    sfree(p);
 }
 
-size_t _num_free_bytes()
+void operator delete(void* p,size_t size) noexcept
 {
-    return sBlockManager->numFreeBytes();
+    sfree_sized(p,size);
 }
 
-size_t _num_allocated_blocks()
+void operator delete[](void* p,size_t size) noexcept
 {
-    return sBlockManager->numAllocatedBlocks();
+    sfree_sized(p,size);
 }
 
-size_t _num_allocated_bytes()
+#if __cpp_aligned_new
+void* operator new(size_t size,std::align_val_t alignment)
 {
-    return sBlockManager->numAllocatedBytes();    
+    return NewOrThrow(size,(size_t)alignment);
 }
 
-size_t _num_meta_data_bytes()
+void* operator new[](size_t size,std::align_val_t alignment)
 {
-    return sBlockManager->numMetaDataBytes();    
+    return NewOrThrow(size,(size_t)alignment);
 }
 
-size_t _size_meta_data()
+void* operator new(size_t size,std::align_val_t alignment,const std::nothrow_t&) noexcept
 {
-    return sBlockManager->numMetaData();    
+    return NewOrNull(size,(size_t)alignment);
+}
+
+void* operator new[](size_t size,std::align_val_t alignment,const std::nothrow_t&) noexcept
+{
+    return NewOrNull(size,(size_t)alignment);
+}
+
+void operator delete(void* p,std::align_val_t) noexcept
+{
+    sfree(p);
+}
+
+void operator delete[](void* p,std::align_val_t) noexcept
+{
+    sfree(p);
+}
+
+void operator delete(void* p,std::align_val_t,const std::nothrow_t&) noexcept
+{
+    sfree(p);
+}
+
+void operator delete[](void* p,std::align_val_t,const std::nothrow_t&) noexcept
+{
+    sfree(p);
+}
+
+void operator delete(void* p,size_t,std::align_val_t) noexcept
+{
+    sfree(p);
+}
+
+void operator delete[](void* p,size_t,std::align_val_t) noexcept
+{
+    sfree(p);
 }
+#endif
+#endif
@@ -0,0 +1,783 @@
+#include <cstddef>
+#include <unistd.h>
+#include <stdbool.h>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <new>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/**
+ * Micro-benchmarks of the allocators, built once per allocator (make bench): bench_malloc_2, bench_malloc_3 and
+ * bench_malloc_4 link the matching malloc_N.cpp, bench_glibc maps the same calls to the libc allocator.
+ * Every workload runs in a child process of its own, so it starts from an empty heap, its peak RSS is its own
+ * and a crash of the allocator is reported instead of ending the run. Results are printed as CSV or JSON lines.
+ * The sbrk based allocators share the program break with libc, so nothing here calls malloc while a workload
+ * runs: buffers are static and output goes through snprintf and write.
+ */
+
+#ifndef BENCH_ALLOCATOR
+#define BENCH_ALLOCATOR "unknown"
+#endif
+
+#ifdef BENCH_LIBC
+void* smalloc(size_t size)
+{
+    return malloc(size);
+}
+
+void* scalloc(size_t num,size_t size)
+{
+    return calloc(num,size);
+}
+
+void sfree(void* p)
+{
+    free(p);
+}
+
+void* srealloc(void* oldp,size_t size)
+{
+    return realloc(oldp,size);
+}
+#else
+void* smalloc(size_t size);
+void* scalloc(size_t num,size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp,size_t size);
+#endif
+
+#define LATENCY_BUCKETS 512 //16 exact ones, then eight per power of two
+#define MAX_THREADS 16
+#define MAX_SLOTS 65536
+#define PAGE 4096
+
+/**
+ * malloc_2 and malloc_3 are not thread safe: built with BENCH_SERIALIZE every call takes one global lock,
+ * so the threaded workloads measure them serialized.
+ */
+#ifdef BENCH_SERIALIZE
+pthread_mutex_t allocator_lock=PTHREAD_MUTEX_INITIALIZER;
+#define ALLOCATOR_LOCK() pthread_mutex_lock(&allocator_lock)
+#define ALLOCATOR_UNLOCK() pthread_mutex_unlock(&allocator_lock)
+#else
+#define ALLOCATOR_LOCK()
+#define ALLOCATOR_UNLOCK()
+#endif
+
+unsigned long Ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000UL+ts.tv_nsec;
+#endif
+}
+
+double Seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+//xorshift64*, one per thread
+class Random
+{
+    private:
+    unsigned long state;
+
+    public:
+
+    explicit Random(unsigned long seed) :state(seed*0x9E3779B97F4A7C15UL | 1)
+    {
+    }
+
+    unsigned long Next()
+    {
+        state^=state>>12;
+        state^=state<<25;
+        state^=state>>27;
+        return state*0x2545F4914F6CDD1DUL;
+    }
+
+    //uniform in [low,high]
+    size_t Range(size_t low,size_t high)
+    {
+        return low+Next()%(high-low+1);
+    }
+
+    //sizes between low and high with every power of two equally likely, like most programs ask for
+    size_t LogRange(size_t low,size_t high)
+    {
+        int low_log=63-__builtin_clzl(low);
+        int high_log=63-__builtin_clzl(high);
+        size_t base=1UL<<Range(low_log,high_log);
+        size_t size=base+Next()%base;
+        return (size<low)? low : (size>high)? high : size;
+    }
+};
+
+//latencies in ticks, log linear buckets so no sample is stored
+class Histogram
+{
+    private:
+    unsigned long buckets[LATENCY_BUCKETS];
+
+    static int Bucket(unsigned long ticks)
+    {
+        if(ticks<16)
+            return ticks;
+        int e=63-__builtin_clzl(ticks);
+        return 16+(e-4)*8+((ticks>>(e-3)) & 7);
+    }
+
+    static unsigned long LowerBound(int bucket)
+    {
+        if(bucket<16)
+            return bucket;
+        int e=(bucket-16)/8+4;
+        return (1UL<<e)+((unsigned long)((bucket-16)%8)<<(e-3));
+    }
+
+    public:
+
+    Histogram()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        memset(buckets,0,sizeof(buckets));
+    }
+
+    void Add(unsigned long ticks)
+    {
+        buckets[Bucket(ticks)]++;
+    }
+
+    void Merge(const Histogram& other)
+    {
+        for(int i=0;i<LATENCY_BUCKETS;i++)
+            buckets[i]+=other.buckets[i];
+    }
+
+    unsigned long Count() const
+    {
+        unsigned long count=0;
+        for(int i=0;i<LATENCY_BUCKETS;i++)
+            count+=buckets[i];
+        return count;
+    }
+
+    //the lower bound of the bucket holding the fraction q of the samples, so within 12.5% below the real value
+    unsigned long Percentile(double q) const
+    {
+        unsigned long count=Count();
+        unsigned long rank=(unsigned long)(q*count);
+        unsigned long seen=0;
+        for(int i=0;i<LATENCY_BUCKETS;i++)
+        {
+            seen+=buckets[i];
+            if(seen>rank)
+                return LowerBound(i);
+        }
+        return 0;
+    }
+};
+
+//the calls every workload makes, timed one by one into the histogram of the calling thread
+class Allocator
+{
+    public:
+
+    static void* Malloc(Histogram* histogram,size_t size)
+    {
+        unsigned long start=Ticks();
+        ALLOCATOR_LOCK();
+        void* ptr=smalloc(size);
+        ALLOCATOR_UNLOCK();
+        histogram->Add(Ticks()-start);
+        return ptr;
+    }
+
+    static void* Calloc(Histogram* histogram,size_t num,size_t size)
+    {
+        unsigned long start=Ticks();
+        ALLOCATOR_LOCK();
+        void* ptr=scalloc(num,size);
+        ALLOCATOR_UNLOCK();
+        histogram->Add(Ticks()-start);
+        return ptr;
+    }
+
+    static void* Realloc(Histogram* histogram,void* oldp,size_t size)
+    {
+        unsigned long start=Ticks();
+        ALLOCATOR_LOCK();
+        void* ptr=srealloc(oldp,size);
+        ALLOCATOR_UNLOCK();
+        histogram->Add(Ticks()-start);
+        return ptr;
+    }
+
+    static void Free(Histogram* histogram,void* p)
+    {
+        unsigned long start=Ticks();
+        ALLOCATOR_LOCK();
+        sfree(p);
+        ALLOCATOR_UNLOCK();
+        histogram->Add(Ticks()-start);
+    }
+};
+
+//resident bytes of the process right now, read without allocating
+size_t ResidentBytes()
+{
+    char buffer[128];
+    int fd=open("/proc/self/statm",O_RDONLY);
+    if(fd<0)
+        return 0;
+    ssize_t length=read(fd,buffer,sizeof(buffer)-1);
+    close(fd);
+    if(length<=0)
+        return 0;
+    buffer[length]='\0';
+    char* resident=strchr(buffer,' ');
+    return (resident==NULL)? 0 : strtoul(resident+1,NULL,10)*sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * What a workload reports. The fragmentation is taken at the checkpoint, when the live set is largest:
+ * 1 - live bytes / resident bytes the workload added, the share of the memory it holds which no block uses.
+ */
+typedef struct Result{
+    unsigned long ops;
+    double seconds;
+    unsigned long p50_ns;
+    unsigned long p99_ns;
+    unsigned long p999_ns;
+    size_t peak_rss_kb;
+    size_t live_bytes;
+    double fragmentation;
+    int threads;
+    bool failed; //an allocation returned NULL
+}Result;
+
+/**
+ * State shared by the threads of one workload. Every workload has a scale, the number of operations of a
+ * thread is its base count times scale.
+ */
+class Workload
+{
+    public:
+    Histogram histograms[MAX_THREADS];
+    size_t baseline_rss;
+    size_t live_bytes;
+    size_t checkpoint_rss;
+    bool failed;
+    int scale;
+
+    Workload(int scale) :baseline_rss(ResidentBytes()), live_bytes(0), checkpoint_rss(0), failed(false), scale(scale)
+    {
+    }
+
+    void Checkpoint(size_t live)
+    {
+        size_t rss=ResidentBytes();
+        if(rss>checkpoint_rss)
+        {
+            checkpoint_rss=rss;
+            live_bytes=live;
+        }
+    }
+
+    void Check(void* ptr)
+    {
+        if(ptr==NULL)
+            failed=true;
+    }
+};
+
+void* slots[MAX_THREADS][MAX_SLOTS];
+size_t slot_sizes[MAX_THREADS][MAX_SLOTS];
+
+//writes a byte per page, so the memory a block takes is really resident
+void Touch(void* ptr,size_t size)
+{
+    for(size_t i=0;i<size;i+=PAGE)
+        ((char*)ptr)[i]=1;
+    ((char*)ptr)[size-1]=1;
+}
+
+//fixed size churn: 64 byte blocks replaced at random among 1024 live ones
+unsigned long FixedChurn(Workload* w)
+{
+    Random random(1);
+    Histogram* h=&w->histograms[0];
+    const int live=1024;
+    unsigned long ops=0;
+    for(int i=0;i<live;i++,ops++)
+        w->Check(slots[0][i]=Allocator::Malloc(h,64));
+    for(long i=0;i<1000000L*w->scale;i++,ops+=2)
+    {
+        int j=random.Next()%live;
+        Allocator::Free(h,slots[0][j]);
+        w->Check(slots[0][j]=Allocator::Malloc(h,64));
+    }
+    w->Checkpoint(live*64);
+    for(int i=0;i<live;i++,ops++)
+        Allocator::Free(h,slots[0][i]);
+    return ops;
+}
+
+//random sizes between 8 bytes and 8KB among 4096 live blocks, one allocation in ten a calloc
+unsigned long RandomSizes(Workload* w)
+{
+    Random random(2);
+    Histogram* h=&w->histograms[0];
+    const int live=4096;
+    unsigned long ops=0;
+    size_t live_bytes=0;
+    for(int i=0;i<live;i++,ops++)
+    {
+        slot_sizes[0][i]=random.LogRange(8,8192);
+        live_bytes+=slot_sizes[0][i];
+        w->Check(slots[0][i]=Allocator::Malloc(h,slot_sizes[0][i]));
+    }
+    for(long i=0;i<500000L*w->scale;i++,ops+=2)
+    {
+        int j=random.Next()%live;
+        Allocator::Free(h,slots[0][j]);
+        live_bytes-=slot_sizes[0][j];
+        size_t size=random.LogRange(8,8192);
+        slots[0][j]= (random.Next()%10==0)? Allocator::Calloc(h,1,size) : Allocator::Malloc(h,size);
+        w->Check(slots[0][j]);
+        slot_sizes[0][j]=size;
+        live_bytes+=size;
+    }
+    w->Checkpoint(live_bytes);
+    for(int i=0;i<live;i++,ops++)
+        Allocator::Free(h,slots[0][i]);
+    return ops;
+}
+
+/**
+ * Producer/consumer: one thread allocates and hands the blocks to another through a ring, which frees them,
+ * so every free is a free from a foreign thread.
+ */
+#define RING_SIZE 4096
+typedef struct Ring{
+    void* blocks[RING_SIZE];
+    size_t sizes[RING_SIZE];
+    unsigned long head; //written by the producer
+    unsigned long tail; //written by the consumer
+    unsigned long count;
+    Workload* workload;
+}Ring;
+
+Ring ring;
+
+void* Producer(void*)
+{
+    Random random(3);
+    Histogram* h=&ring.workload->histograms[0];
+    for(unsigned long i=0;i<ring.count;i++)
+    {
+        while(i-__atomic_load_n(&ring.tail,__ATOMIC_ACQUIRE)>=RING_SIZE)
+            sched_yield();
+        size_t size=random.LogRange(16,512);
+        void* ptr=Allocator::Malloc(h,size);
+        ring.workload->Check(ptr);
+        ring.blocks[i%RING_SIZE]=ptr;
+        ring.sizes[i%RING_SIZE]=size;
+        __atomic_store_n(&ring.head,i+1,__ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void* Consumer(void*)
+{
+    Histogram* h=&ring.workload->histograms[1];
+    size_t live_bytes=0;
+    for(unsigned long i=0;i<ring.count;i++)
+    {
+        while(__atomic_load_n(&ring.head,__ATOMIC_ACQUIRE)<=i)
+            sched_yield();
+        if(i%(ring.count/4+1)==0)//while the ring is about full
+        {
+            live_bytes=0;
+            for(int k=0;k<RING_SIZE;k++)
+                live_bytes+=ring.sizes[k];
+            ring.workload->Checkpoint(live_bytes);
+        }
+        Allocator::Free(h,ring.blocks[i%RING_SIZE]);
+        __atomic_store_n(&ring.tail,i+1,__ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+unsigned long ProducerConsumer(Workload* w)
+{
+    ring.head=0;
+    ring.tail=0;
+    ring.count=1000000UL*w->scale;
+    ring.workload=w;
+    pthread_t producer,consumer;
+    pthread_create(&consumer,NULL,Consumer,NULL);
+    pthread_create(&producer,NULL,Producer,NULL);
+    pthread_join(producer,NULL);
+    pthread_join(consumer,NULL);
+    return 2*ring.count;
+}
+
+/**
+ * Larson: every thread replaces random blocks of its own set, then the sets rotate between the threads,
+ * so blocks allocated by one thread are freed by the next one, like a server handing requests around.
+ */
+#define LARSON_THREADS 4
+#define LARSON_SLOTS 1024
+#define LARSON_ROUNDS 8
+
+typedef struct LarsonThread{
+    Workload* workload;
+    int index;
+    int set; //the set of slots this thread works on in the current round
+}LarsonThread;
+
+pthread_barrier_t larson_barrier;
+
+void* Larson(void* arg)
+{
+    LarsonThread* t=(LarsonThread*)arg;
+    Random random(10+t->index);
+    Histogram* h=&t->workload->histograms[t->index];
+    for(int round=0;round<LARSON_ROUNDS;round++)
+    {
+        int set=(t->index+round)%LARSON_THREADS;
+        for(long i=0;i<25000L*t->workload->scale;i++)
+        {
+            int j=random.Next()%LARSON_SLOTS;
+            Allocator::Free(h,slots[set][j]);
+            slot_sizes[set][j]=random.Range(16,1024);
+            slots[set][j]=Allocator::Malloc(h,slot_sizes[set][j]);
+            t->workload->Check(slots[set][j]);
+        }
+        pthread_barrier_wait(&larson_barrier);
+        if(t->index==0 && round==LARSON_ROUNDS/2)
+        {
+            size_t live_bytes=0;
+            for(int s=0;s<LARSON_THREADS;s++)
+                for(int k=0;k<LARSON_SLOTS;k++)
+                    live_bytes+=slot_sizes[s][k];
+            t->workload->Checkpoint(live_bytes);
+        }
+        pthread_barrier_wait(&larson_barrier);
+    }
+    return NULL;
+}
+
+unsigned long LarsonWorkload(Workload* w)
+{
+    Histogram* h=&w->histograms[0];
+    for(int s=0;s<LARSON_THREADS;s++)
+    {
+        for(int k=0;k<LARSON_SLOTS;k++)
+        {
+            slot_sizes[s][k]=16;
+            w->Check(slots[s][k]=Allocator::Malloc(h,16));
+        }
+    }
+    LarsonThread threads[LARSON_THREADS];
+    pthread_t ids[LARSON_THREADS];
+    pthread_barrier_init(&larson_barrier,NULL,LARSON_THREADS);
+    for(int i=0;i<LARSON_THREADS;i++)
+    {
+        threads[i].workload=w;
+        threads[i].index=i;
+        pthread_create(&ids[i],NULL,Larson,&threads[i]);
+    }
+    for(int i=0;i<LARSON_THREADS;i++)
+        pthread_join(ids[i],NULL);
+    pthread_barrier_destroy(&larson_barrier);
+    for(int s=0;s<LARSON_THREADS;s++)
+        for(int k=0;k<LARSON_SLOTS;k++)
+            Allocator::Free(h,slots[s][k]);
+    return LARSON_THREADS*LARSON_SLOTS*2+LARSON_THREADS*LARSON_ROUNDS*25000UL*w->scale*2;
+}
+
+//realloc growth: 256 buffers grow by half of their size at a time from 16 bytes to 64KB, as a vector does
+unsigned long ReallocGrowth(Workload* w)
+{
+    Histogram* h=&w->histograms[0];
+    const int buffers=256;
+    unsigned long ops=0;
+    for(int round=0;round<4*w->scale;round++)
+    {
+        size_t size=16;
+        size_t live_bytes=0;
+        for(int i=0;i<buffers;i++,ops++)
+            w->Check(slots[0][i]=Allocator::Malloc(h,size));
+        while(size<64*1024)
+        {
+            size+=size/2;
+            for(int i=0;i<buffers;i++,ops++)
+            {
+                void* ptr=Allocator::Realloc(h,slots[0][i],size);
+                w->Check(ptr);
+                if(ptr!=NULL)
+                {
+                    slots[0][i]=ptr;
+                    ((char*)ptr)[size-1]=1;
+                }
+            }
+            live_bytes=buffers*size;
+        }
+        w->Checkpoint(live_bytes);
+        for(int i=0;i<buffers;i++,ops++)
+            Allocator::Free(h,slots[0][i]);
+    }
+    return ops;
+}
+
+//large blocks between 256KB and 4MB, every page touched, 8 of them live at a time
+unsigned long LargeBlocks(Workload* w)
+{
+    Random random(4);
+    Histogram* h=&w->histograms[0];
+    const int live=8;
+    unsigned long ops=0;
+    size_t live_bytes=0;
+    for(int i=0;i<live;i++)
+        slots[0][i]=NULL;
+    for(long i=0;i<5000L*w->scale;i++)
+    {
+        int j=random.Next()%live;
+        if(slots[0][j]!=NULL)
+        {
+            Allocator::Free(h,slots[0][j]);
+            live_bytes-=slot_sizes[0][j];
+            ops++;
+        }
+        size_t size=random.LogRange(256*1024,4*1024*1024);
+        slots[0][j]=Allocator::Malloc(h,size);
+        ops++;
+        w->Check(slots[0][j]);
+        slot_sizes[0][j]= (slots[0][j]==NULL)? 0 : size;
+        live_bytes+=slot_sizes[0][j];
+        if(slots[0][j]!=NULL)
+            Touch(slots[0][j],size);
+        if(i%1000==999)
+            w->Checkpoint(live_bytes);
+    }
+    for(int i=0;i<live;i++,ops++)
+        Allocator::Free(h,slots[0][i]);
+    return ops;
+}
+
+/**
+ * Fragmentation stress: fills the heap with small blocks of random sizes, frees every other one and then asks
+ * for blocks larger than any hole, which a heap without coalescing or reuse has to take from fresh memory.
+ */
+unsigned long FragmentationStress(Workload* w)
+{
+    Random random(5);
+    Histogram* h=&w->histograms[0];
+    const int count=8192;
+    unsigned long ops=0;
+    for(int round=0;round<w->scale;round++)
+    {
+        size_t live_bytes=0;
+        for(int i=0;i<count;i++,ops++)
+        {
+            slot_sizes[0][i]=random.LogRange(16,2048);
+            w->Check(slots[0][i]=Allocator::Malloc(h,slot_sizes[0][i]));
+            if(slots[0][i]!=NULL)
+                Touch(slots[0][i],slot_sizes[0][i]);
+            live_bytes+=slot_sizes[0][i];
+        }
+        for(int i=0;i<count;i+=2,ops++)
+        {
+            Allocator::Free(h,slots[0][i]);
+            live_bytes-=slot_sizes[0][i];
+        }
+        for(int i=0;i<count;i+=2,ops++)
+        {
+            slot_sizes[0][i]=random.Range(4096,8192);
+            w->Check(slots[0][i]=Allocator::Malloc(h,slot_sizes[0][i]));
+            if(slots[0][i]!=NULL)
+                Touch(slots[0][i],slot_sizes[0][i]);
+            live_bytes+=slot_sizes[0][i];
+        }
+        w->Checkpoint(live_bytes);
+        for(int i=0;i<count;i++,ops++)
+            Allocator::Free(h,slots[0][i]);
+    }
+    return ops;
+}
+
+typedef struct WorkloadEntry{
+    const char* name;
+    unsigned long (*run)(Workload*);
+    int threads;
+}WorkloadEntry;
+
+const WorkloadEntry workloads[]={
+    {"fixed_churn",FixedChurn,1},
+    {"random_sizes",RandomSizes,1},
+    {"producer_consumer",ProducerConsumer,2},
+    {"larson",LarsonWorkload,LARSON_THREADS},
+    {"realloc_growth",ReallocGrowth,1},
+    {"large_blocks",LargeBlocks,1},
+    {"fragmentation",FragmentationStress,1},
+};
+#define NUM_WORKLOADS (int)(sizeof(workloads)/sizeof(workloads[0]))
+
+//static storage, the histograms are too large for the stack of a child
+char workload_storage[sizeof(Workload)] __attribute__((aligned(64)));
+
+size_t PeakResidentKb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_maxrss;
+}
+
+//runs in the child process and returns the result through the pipe
+void RunChild(const WorkloadEntry* entry,int scale,int fd)
+{
+    Workload* w=new(workload_storage) Workload(scale);
+    unsigned long start_ticks=Ticks();
+    double start=Seconds();
+    unsigned long ops=entry->run(w);
+    double seconds=Seconds()-start;
+    double ns_per_tick=seconds*1e9/(Ticks()-start_ticks);
+    Histogram all;
+    for(int i=0;i<MAX_THREADS;i++)
+        all.Merge(w->histograms[i]);
+    Result result;
+    result.ops=ops;
+    result.seconds=seconds;
+    result.p50_ns=(unsigned long)(all.Percentile(0.5)*ns_per_tick);
+    result.p99_ns=(unsigned long)(all.Percentile(0.99)*ns_per_tick);
+    result.p999_ns=(unsigned long)(all.Percentile(0.999)*ns_per_tick);
+    result.peak_rss_kb=PeakResidentKb();
+    result.live_bytes=w->live_bytes;
+    size_t added= (w->checkpoint_rss>w->baseline_rss)? w->checkpoint_rss-w->baseline_rss : 0;
+    result.fragmentation= (added==0 || w->live_bytes>=added)? 0 : 1-(double)w->live_bytes/added;
+    result.threads=entry->threads;
+    result.failed=w->failed;
+    if(write(fd,&result,sizeof(result))!=(ssize_t)sizeof(result))
+        _exit(1);
+    _exit(0);
+}
+
+void Print(const char* text)
+{
+    size_t length=strlen(text);
+    while(length>0)
+    {
+        ssize_t written=write(STDOUT_FILENO,text,length);
+        if(written<=0)
+            return;
+        text+=written;
+        length-=written;
+    }
+}
+
+void PrintResult(const WorkloadEntry* entry,const Result* result,const char* status,bool json)
+{
+    char line[512];
+    double ops_per_sec= (result->seconds>0)? result->ops/result->seconds : 0;
+    if(json)
+        snprintf(line,sizeof(line),"{\"allocator\":\"%s\",\"workload\":\"%s\",\"threads\":%d,\"ops\":%lu,\"seconds\":%.4f,"
+                 "\"ops_per_sec\":%.0f,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"peak_rss_kb\":%zu,"
+                 "\"live_bytes\":%zu,\"fragmentation\":%.4f,\"status\":\"%s\"}\n",
+                 BENCH_ALLOCATOR,entry->name,entry->threads,result->ops,result->seconds,ops_per_sec,result->p50_ns,
+                 result->p99_ns,result->p999_ns,result->peak_rss_kb,result->live_bytes,result->fragmentation,status);
+    else
+        snprintf(line,sizeof(line),"%s,%s,%d,%lu,%.4f,%.0f,%lu,%lu,%lu,%zu,%zu,%.4f,%s\n",
+                 BENCH_ALLOCATOR,entry->name,entry->threads,result->ops,result->seconds,ops_per_sec,result->p50_ns,
+                 result->p99_ns,result->p999_ns,result->peak_rss_kb,result->live_bytes,result->fragmentation,status);
+    Print(line);
+}
+
+void* Idle(void*)
+{
+    return NULL;
+}
+
+void Usage()
+{
+    Print("usage: bench_<allocator> [--json] [--no-header] [--scale N] [--workload NAME]\n"
+          "workloads: fixed_churn random_sizes producer_consumer larson realloc_growth large_blocks fragmentation\n");
+    exit(2);
+}
+
+int main(int argc,char** argv)
+{
+    bool json=false;
+    bool header=true;
+    int scale=1;
+    const char* only=NULL;
+    for(int i=1;i<argc;i++)
+    {
+        if(strcmp(argv[i],"--json")==0)
+            json=true;
+        else if(strcmp(argv[i],"--no-header")==0)
+            header=false;
+        else if(strcmp(argv[i],"--scale")==0 && i+1<argc)
+            scale=atoi(argv[++i]);
+        else if(strcmp(argv[i],"--workload")==0 && i+1<argc)
+            only=argv[++i];
+        else
+            Usage();
+    }
+    if(scale<1)
+        Usage();
+    //libc sets up what a thread needs on the first pthread_create, before any workload owns the heap
+    pthread_t idle;
+    pthread_create(&idle,NULL,Idle,NULL);
+    pthread_join(idle,NULL);
+    if(header && !json)
+        Print("allocator,workload,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kb,live_bytes,fragmentation,status\n");
+    for(int i=0;i<NUM_WORKLOADS;i++)
+    {
+        const WorkloadEntry* entry=&workloads[i];
+        if(only!=NULL && strcmp(only,entry->name)!=0)
+            continue;
+        int fds[2];
+        if(pipe(fds)!=0)
+            return 1;
+        pid_t pid=fork();
+        if(pid<0)
+            return 1;
+        if(pid==0)
+        {
+            close(fds[0]);
+            RunChild(entry,scale,fds[1]);
+        }
+        close(fds[1]);
+        Result result;
+        memset(&result,0,sizeof(result));
+        result.threads=entry->threads;
+        bool received= (read(fds[0],&result,sizeof(result))==(ssize_t)sizeof(result));
+        close(fds[0]);
+        int status;
+        waitpid(pid,&status,0);
+        const char* state="ok";
+        if(!received || !WIFEXITED(status) || WEXITSTATUS(status)!=0)
+            state= (WIFSIGNALED(status))? "crashed" : "error";
+        else if(result.failed)
+            state="alloc_failed";
+        PrintResult(entry,&result,state,json);
+    }
+    return 0;
+}
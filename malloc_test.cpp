@@ -0,0 +1,59 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+/**
+ * Regression checks of malloc_4, built and run by make test. Every check aborts with its line on failure.
+ */
+
+void* smalloc(size_t size);
+void* smemalign(size_t alignment,size_t size);
+void sfree_sized(void* p,size_t size);
+size_t smalloc_usable_size(void* p);
+size_t _num_free_blocks();
+size_t _num_allocated_blocks();
+
+#define CHECK(condition) do{ if(!(condition)){ fprintf(stderr,"%s:%d: %s failed\n",__FILE__,__LINE__,#condition); abort(); } }while(0)
+
+/**
+ * sfree_sized picks the slab class from the size alone, so smemalign must serve a small request from the class
+ * of its size or from the heap, never from a larger class. Otherwise the slot would go back to the wrong class
+ * and smalloc of that class would get it.
+ */
+void TestSizedFreeOfAlignedSlots()
+{
+    size_t usable[1024+1];
+    for(size_t size=1;size<=1024;size+=37)
+    {
+        void* p=smalloc(size);
+        CHECK(p!=NULL);
+        usable[size]=smalloc_usable_size(p);
+        sfree_sized(p,size);
+    }
+    for(int round=0;round<100;round++)
+    {
+        for(size_t alignment=16;alignment<=64;alignment*=2)
+        {
+            for(size_t size=1;size<=1024;size+=37)
+            {
+                void* p=smemalign(alignment,size);
+                CHECK(p!=NULL);
+                CHECK((uintptr_t)p%alignment==0);
+                sfree_sized(p,size);
+                void* q=smalloc(size);
+                CHECK(q!=NULL);
+                CHECK(smalloc_usable_size(q)==usable[size]);
+                sfree_sized(q,size);
+            }
+        }
+    }
+    CHECK(_num_free_blocks()<=_num_allocated_blocks());
+}
+
+int main()
+{
+    TestSizedFreeOfAlignedSlots();
+    printf("OK\n");
+    return 0;
+}